@@ -29,6 +29,15 @@ namespace JackalRenderer {
     };
     using JVertexBuffer = vector<JVertex>;
     using JIndexBuffer = vector<uint>;
+    //structure of arrays layout of a vertex buffer, one stream per attribute
+    struct JVertexStreams {
+        vector<glm::vec3> positions;
+        vector<glm::vec3> normals;
+        vector<glm::vec2> texcoords;
+        vector<glm::vec3> tangents;
+        vector<glm::vec3> bitangents;
+        size_t size() const { return positions.size(); }
+    };
 
     class JDrawableSubMesh {
     public:
@@ -39,7 +48,7 @@ namespace JackalRenderer {
         JDrawableSubMesh(const JDrawableSubMesh& mesh);
         JDrawableSubMesh& operator=(const JDrawableSubMesh& mesh);
 
-        void setVertices(const vector<JVertex>& vertices) { this -> vertices = vertices; }
+        void setVertices(const vector<JVertex>& vertices);
         void setIndices(const vector<uint>& indices) { this -> indices = indices; }
 
         void setDiffuseMapTexId(const int& id) { drawingMaterial.diffuseMapTexId = id; }
@@ -57,10 +66,21 @@ namespace JackalRenderer {
         const vector<JVertex>& getVertices() const { return this -> vertices; }
         const vector<uint>& getIndices() const { return this -> indices; }
 
+        /**
+         * @brief J_VERTEX_SOA moves the vertices into separate attribute streams for batched vertex shading,
+         * getVertices() is empty then. J_VERTEX_AOS moves them back into JVertex records
+         */
+        void setVertexLayout(JVertexLayout layout);
+        JVertexLayout getVertexLayout() const { return this -> layout; }
+        const JVertexStreams& getVertexStreams() const { return this -> streams; }
+        size_t getVertexNum() const { return layout == J_VERTEX_SOA ? streams.size() : vertices.size(); }
+
         void clear();
     protected:
         JVertexBuffer vertices;
         JIndexBuffer indices;
+        JVertexLayout layout = J_VERTEX_AOS;
+        JVertexStreams streams; //only filled with the J_VERTEX_SOA layout
         struct DrawableMaterialTex {
             int diffuseMapTexId = -1;
             int specularMapTexId = -1;
@@ -83,6 +103,8 @@ namespace JackalRenderer {
         void setDepthWriteMode(JDepthWriteMode mode) { drawable_config.depthwritemode = mode; }
         void setAlphaBlendMode(JAlphaBlendingMode mode) { drawable_config.alphablendingmode = mode; }
         void setModeMatrix(const glm::mat4& mat) { drawable_config.modelMatrix = mat; }
+        //vertex layout of every submesh, see JDrawableSubMesh::setVertexLayout
+        void setVertexLayout(JVertexLayout layout);
         void setLightingMode(JLightingMode mode) { drawable_config.lighringmode = mode; }
 
         void setAmbientCoff(const glm::vec3& cof) { drawable_material_config.kA = cof; }
@@ -14,11 +14,32 @@
 namespace JackalRenderer {
     using uint = unsigned int;
 
+    /**
+     * @brief surface attributes of a pixel for deferred shading, written by the geometry pass
+     * and lit once by the lighting pass, see JShadingPipeline::fragmentSurfaceQuad
+     */
+    struct JGBufferTexel {
+        glm::vec3 position; //world space, instead of reconstructing it from the depth
+        glm::vec3 normal; //normalized
+        glm::vec3 albedo; //diffuse color, also the ambient color
+        glm::vec3 ambientCoef; //kA of the material
+        glm::vec3 diffuseCoef; //kD
+        glm::vec3 specular;
+        glm::vec3 emission;
+        float shininess;
+        float alpha;
+        bool lit; //false: the color is the emission
+    };
+
     class JFrameBuffer final {
     public:
         using ptr = std::shared_ptr<JFrameBuffer>;
 
-        JFrameBuffer(int width, int height);
+        /**
+         * @brief samplingNum (1, 2, 4 or 8) sampling points are stored per pixel,
+         * the masked writes below have to be called with a mask of the same sampling number
+         */
+        JFrameBuffer(int width, int height, int samplingNum = JDefaultSamplingNum);
         ~JFrameBuffer() = default;
         void clearDepth(const float &depth);
         void clearColor(const glm::vec4 &color);
@@ -26,6 +47,7 @@ namespace JackalRenderer {
 
         int getWidth() const { return width; }
         int getHeight() const { return height; }
+        int getSamplingNum() const { return samplingNum; }
         const JDepthBuffer &getDepthBuffer() const { return depthBuffer; }
         const JColorBuffer &getColorBuffer() const {return colorBuffer; }
 
@@ -35,17 +57,89 @@ namespace JackalRenderer {
 
         void writeDepth(const uint &x, const uint &y, const uint &i, const float &value);
         void writeColor(const uint &x, const uint &y, const uint &i, const glm::vec4 &color);
-        // using JMaskPixelSampler = JPixelSampler<unsigned char>;
-        void writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JMaskPixelSampler &mask);
-        void writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const JMaskPixelSampler &mask);
-        void writeDepthWithMask(const uint &x, const uint &y, const JDepthPixelSampler &depth, const JMaskPixelSampler &mask);
+        //N has to match getSamplingNum(), instantiated for 1, 2, 4 and 8
+        template<int N>
+        void writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JTMaskPixelSampler<N> &mask);
+        template<int N>
+        void writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const JTMaskPixelSampler<N> &mask);
+        template<int N>
+        void writeDepthWithMask(const uint &x, const uint &y, const JTDepthPixelSampler<N> &depth, const JTMaskPixelSampler<N> &mask);
+
+        /**
+         * @brief deferred shading attachments, one G-buffer texel per sampling point plus the surface it belongs to,
+         * so that the sampling points on either side of an edge are lit by their own surface.
+         * Resets the surfaces, the attachments are allocated on first use
+         */
+        void clearGBuffer();
+        const JGBufferTexel &readGBuffer(const uint &x, const uint &y, const uint &i) const { return gBuffer[(y * width + x) * samplingNum + i]; }
+        /**
+         * @brief the surface of the sampling point i at (x, y), 0 if none was written there. Sampling points of a pixel
+         * with the same surface hold the same texel, i.e. one lighting of it is enough for all of them
+         */
+        unsigned char readGBufferSurface(const uint &x, const uint &y, const uint &i) const { return gBufferSurface[(y * width + x) * samplingNum + i]; }
+        //the sampling points in the mask take the texel as a new surface, the others keep theirs
+        template<int N>
+        void writeGBufferWithMask(const uint &x, const uint &y, const JGBufferTexel &texel, const JTMaskPixelSampler<N> &mask);
+
+        /**
+         * @brief weighted blended order independent transparency attachments, per sampling point the weighted
+         * premultiplied color sum and the product of (1 - alpha). Resets them, they are allocated on first use
+         */
+        void clearOIT();
+        /**
+         * @brief accumulates a transparent fragment, commutative so that the fragments of a pixel can arrive in any order
+         * @param depth rhw of the sampling points, weights nearer fragments higher
+         */
+        template<int N>
+        void writeOITWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JTDepthPixelSampler<N> &depth, const JTMaskPixelSampler<N> &mask);
+        //composites the accumulated transparent surfaces over the color buffer, before resolve()
+        void resolveOIT();
+
+        /**
+         * @brief sort-last compositing, every sampling point takes the depth, and the color if withColor, of the source
+         * nearest to the viewer. Sources that are not nearer than this framebuffer leave it as it is.
+         * The sources need the size and the sampling number of this framebuffer
+         */
+        void compositeNearest(const std::vector<const JFrameBuffer*> &sources, const bool &withColor);
+        //copies the depth of src, which has the size and the sampling number of this framebuffer
+        void copyDepth(const JFrameBuffer &src);
 
-        // using JColorBuffer = std::vector<JColorPixelSampler>;
+        //averages the sampling points of every pixel into its first one, i.e. colorBuffer[index * samplingNum]
         const JColorBuffer &resolve();
+
+        //hierarchical z: coarse min/max depth of every HIZ_BLOCK_SIZE x HIZ_BLOCK_SIZE block
+        static constexpr int HIZ_BLOCK_SIZE = 8;
+        /**
+         * @brief marks the block containing (x, y) as stale, it is recomputed on its next query.
+         * not thread safe, callers must own the block (e.g. the tile worker it belongs to)
+         */
+        void invalidateHiZ(const uint &x, const uint &y);
+        void invalidateHiZ();
+        /**
+         * @brief true if every sample inside the pixel rect [pmin, pmax] already holds a depth
+         * at least as near as nearestDepth, i.e. nothing that near can pass the depth test
+         * @param depthEqual depth-equal testing, samples exactly at nearestDepth still pass
+         */
+        bool isHiZOccluded(const glm::ivec2 &pmin, const glm::ivec2 &pmax, const float &nearestDepth, const bool &depthEqual = false);
     private:
+        const glm::vec2 &readHiZ(const uint &bx, const uint &by);
+        template<int N>
+        void resolveSampled();
+
         JDepthBuffer depthBuffer;
         JColorBuffer colorBuffer;
         unsigned int width, height;
+        int samplingNum;
+
+        std::vector<JGBufferTexel> gBuffer;
+        std::vector<unsigned char> gBufferSurface; //per sampling point, unique among the surfaces of its pixel
+
+        std::vector<glm::vec4> oitAccum; //rgb: sum of weighted premultiplied colors, a: sum of weighted alphas
+        std::vector<float> oitRevealage; //product of (1 - alpha), 1 where nothing transparent was written
+
+        unsigned int hiZWidth, hiZHeight;
+        std::vector<glm::vec2> hiZBuffer; //x: farthest(min) depth, y: nearest(max) depth of a block
+        std::vector<unsigned char> hiZStale;
     };
 
 }
@@ -45,6 +45,8 @@ namespace JackalRenderer{
         glm::vec3 &getLightPos() {
             return JlightPos;
         }
+        //constant, linear and quadratic coefficients
+        const glm::vec3 &getAttenuation() const { return JAttenuation; }
 
     protected:
         glm::vec3 JlightPos;
@@ -60,12 +62,14 @@ namespace JackalRenderer{
                 : JPointLight(intensity, lightPos, atten), JSpotDir(glm::normalize(dir)), JinnerCutoff(innerCutoff), JouterCutoff(outerCutoff) {}
         virtual float cutoff(const glm::vec3 &lightDir) const override {
             float theta = glm::dot(lightDir, JSpotDir);
-            static const float epsilon = JinnerCutoff - JouterCutoff;
+            float epsilon = JinnerCutoff - JouterCutoff;
             return glm::clamp((theta - JouterCutoff) / epsilon, 0.0f, 1.0f);
         }
         glm::vec3 &getSpotDir() {
             return JSpotDir;
         }
+        float getInnerCutoff() const { return JinnerCutoff; }
+        float getOuterCutoff() const { return JouterCutoff; }
     protected:
         glm::vec3 JSpotDir;
         float JinnerCutoff;
@@ -80,6 +84,7 @@ namespace JackalRenderer{
         virtual float attenuation(const glm::vec3 &fragPos) const override { return 1.0f; }
         virtual glm::vec3 direction(const glm::vec3 &fragPos) const override { return JLightDir; }
         virtual float cutoff(const glm::vec3 &lightDir) const override { return 1.0f; };
+        const glm::vec3 &getLightDir() const { return JLightDir; }
     protected:
         glm::vec3 JLightDir;
     };
@@ -0,0 +1,174 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#ifndef JLIGHTTABLE_H
+#define JLIGHTTABLE_H
+
+#include <vector>
+#include <algorithm>
+#include "JLight.h"
+#include "JQuadLanes.h"
+
+using std::vector;
+
+namespace JackalRenderer {
+    /**
+     * @brief the lights of a frame compiled into type segregated structure of arrays tables, shaders evaluate them
+     * with straight-line SIMD code instead of three virtual calls per fragment and light.
+     * Lights of other JLight subclasses stay behind the virtual interface in others
+     */
+    class JLightTable {
+    public:
+        struct DirectLights {
+            vector<float> dirX, dirY, dirZ; //towards the light
+        };
+        struct PointLights {
+            vector<float> posX, posY, posZ;
+            vector<float> attConstant, attLinear, attQuadratic;
+            vector<float> radius; //influence radius, see influenceRadius
+        };
+        struct SpotLights {
+            vector<float> posX, posY, posZ;
+            vector<float> attConstant, attLinear, attQuadratic;
+            vector<float> radius;
+            vector<float> dirX, dirY, dirZ; //spot direction
+            vector<float> outerCutoff, cutoffRange; //cosines, cutoffRange = inner - outer
+        };
+
+        //rebuilds the tables from lights, the order of the light types is directional, point, spot, others
+        void compile(const vector<JLight::ptr>& lights);
+
+        size_t size() const { return intensity.size(); }
+        //first table index of the point, spot and other lights, directional lights start at 0
+        size_t pointBegin() const { return direct.dirX.size(); }
+        size_t spotBegin() const { return pointBegin() + point.posX.size(); }
+        size_t othersBegin() const { return spotBegin() + spot.posX.size(); }
+
+        /**
+         * @brief distance beyond which intensity * attenuation stays below INFLUENCE_THRESHOLD,
+         * infinite for lights that do not fall off
+         */
+        static float influenceRadius(const glm::vec3& intensity, const glm::vec3& attenuation);
+        static constexpr float INFLUENCE_THRESHOLD = 1.0f / 256.0f;
+
+        /**
+         * @brief calls shade(i, lightDir, attenuation, cutoff) for every light at the fragments of a quad,
+         * i indexes intensity. The values are those of JLight::direction, attenuation and cutoff bit for bit
+         * @param fragPos world positions of the fragments, pos the same in lanes
+         */
+        template<typename F>
+        void forEachQuadLight(const glm::vec3 fragPos[4], const QuadVec3& pos, F shade) const;
+
+        //light lists of up to 4 clusters, each sorted by table index
+        struct QuadLights {
+            const unsigned int* begin[4];
+            const unsigned int* end[4];
+            int num = 0;
+        };
+        //forEachQuadLight for the lights of the merged lists only, every light is visited once and in table order
+        template<typename F>
+        void forEachQuadLight(const glm::vec3 fragPos[4], const QuadVec3& pos, QuadLights lists, F shade) const;
+
+        DirectLights direct;
+        PointLights point;
+        SpotLights spot;
+        vector<JLight::ptr> others;
+        vector<glm::vec3> intensity; //of all lights in table order
+
+    private:
+        //shade(i, ...) for the light with table index i
+        template<typename F>
+        void evaluateQuadLight(const size_t& i, const glm::vec3 fragPos[4], const QuadVec3& pos, F& shade) const;
+    };
+
+    /**
+     * @brief clustered light culling, the view frustum is split into screen tiles times exponential depth slices
+     * and every cluster lists the lights whose influence reaches it. Directional and other lights are in every cluster
+     */
+    class JLightClusters {
+    public:
+        static constexpr int TILE_SIZE = 32; //pixels, even so that a 2x2 quad never straddles two tiles
+        static constexpr int DEPTH_SLICES = 16;
+
+        //assigns the lights of table to the clusters of the frustum, in parallel over the clusters
+        void build(const JLightTable& table, const glm::mat4& view, const glm::mat4& project,
+            const int& width, const int& height, const float& near, const float& far);
+        bool empty() const { return clusterLights.empty(); }
+
+        /**
+         * @brief the light lists of the clusters the fragments of a quad fall into
+         * @param quadPos screen position of the top-left pixel
+         * @param laneMask fragments with a valid fragPos, helper fragments are not interpolated
+         */
+        void quadLights(const glm::ivec2& quadPos, const glm::vec3 fragPos[4], const unsigned int& laneMask, JLightTable::QuadLights& lights) const;
+
+    private:
+        int depthSlice(const glm::vec3& worldPos) const;
+
+        int tilesX = 0;
+        int tilesY = 0;
+        float nearDepth = 0.1f;
+        float sliceScale = 1.0f; //DEPTH_SLICES / log(far / near)
+        glm::vec4 viewDepthRow = glm::vec4(0.0f); //view space depth (-z) of a world position
+        vector<vector<unsigned int>> clusterLights; //tile-major, then slice
+    };
+
+    template<typename F>
+    void JLightTable::evaluateQuadLight(const size_t& i, const glm::vec3 fragPos[4], const QuadVec3& pos, F& shade) const {
+        const QuadFloat one(1.0f);
+        if(i < pointBegin()) {
+            shade(i, QuadVec3(QuadFloat(direct.dirX[i]), QuadFloat(direct.dirY[i]), QuadFloat(direct.dirZ[i])), one, one);
+        }else if(i < spotBegin()) {
+            const size_t l = i - pointBegin();
+            const QuadVec3 toLight = QuadVec3(QuadFloat(point.posX[l]), QuadFloat(point.posY[l]), QuadFloat(point.posZ[l])) - pos;
+            const QuadFloat distance = lanesSqrt(dot(toLight, toLight));
+            const QuadFloat attenuation = one / ((QuadFloat(point.attConstant[l]) + QuadFloat(point.attLinear[l]) * distance)
+                + QuadFloat(point.attQuadratic[l]) * (distance * distance));
+            shade(i, normalize(toLight), attenuation, one);
+        }else if(i < othersBegin()) {
+            const size_t l = i - spotBegin();
+            const QuadVec3 toLight = QuadVec3(QuadFloat(spot.posX[l]), QuadFloat(spot.posY[l]), QuadFloat(spot.posZ[l])) - pos;
+            const QuadFloat distance = lanesSqrt(dot(toLight, toLight));
+            const QuadFloat attenuation = one / ((QuadFloat(spot.attConstant[l]) + QuadFloat(spot.attLinear[l]) * distance)
+                + QuadFloat(spot.attQuadratic[l]) * (distance * distance));
+            const QuadVec3 lightDir = normalize(toLight);
+            const QuadFloat theta = dot(lightDir, QuadVec3(QuadFloat(spot.dirX[l]), QuadFloat(spot.dirY[l]), QuadFloat(spot.dirZ[l])));
+            //glm::clamp((theta - outer) / epsilon, 0, 1)
+            const QuadFloat cutoff = lanesMin(lanesMax((theta - QuadFloat(spot.outerCutoff[l])) / QuadFloat(spot.cutoffRange[l]), QuadFloat(0.0f)), one);
+            shade(i, lightDir, attenuation, cutoff);
+        }else {
+            QuadVec3 lightDir;
+            QuadFloat attenuation, cutoff;
+            JackalRenderer::evaluateQuadLight(*others[i - othersBegin()], fragPos, lightDir, attenuation, cutoff);
+            shade(i, lightDir, attenuation, cutoff);
+        }
+    }
+
+    template<typename F>
+    void JLightTable::forEachQuadLight(const glm::vec3 fragPos[4], const QuadVec3& pos, F shade) const {
+        for(size_t i = 0; i < size(); ++i)
+            evaluateQuadLight(i, fragPos, pos, shade);
+    }
+
+    template<typename F>
+    void JLightTable::forEachQuadLight(const glm::vec3 fragPos[4], const QuadVec3& pos, QuadLights lists, F shade) const {
+        //merges the sorted lists, the smallest head is the next light
+        while(true) {
+            unsigned int next = ~0u;
+            for(int k = 0; k < lists.num; ++k) {
+                if(lists.begin[k] != lists.end[k])
+                    next = std::min(next, *lists.begin[k]);
+            }
+            if(next == ~0u)
+                return;
+            for(int k = 0; k < lists.num; ++k) {
+                if(lists.begin[k] != lists.end[k] && *lists.begin[k] == next)
+                    ++lists.begin[k];
+            }
+            evaluateQuadLight(next, fragPos, pos, shade);
+        }
+    }
+}
+
+#endif //JLIGHTTABLE_H
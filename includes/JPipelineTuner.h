@@ -0,0 +1,74 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#ifndef JPIPELINETUNER_H
+#define JPIPELINETUNER_H
+
+#include <string>
+#include <cstddef>
+
+using std::string;
+
+namespace JackalRenderer {
+    //how the frame stream is cut into work items
+    struct JPipelineTuning {
+        int chunkFaces = 512; //faces per binning chunk, J_RASTER_TILE_BINNING
+        int inflightFaces = 512; //faces in flight in the pipeline, J_RASTER_PIXEL_LOCK
+        int sortLastFaces = 512; //faces rendered per work item into a private framebuffer, J_RASTER_SORT_LAST
+    };
+
+    //measured while a frame stream is rendered
+    struct JPipelineStats {
+        size_t faces = 0;
+        size_t triangles = 0; //after clipping and culling
+        size_t quads = 0; //2x2 quads rasterized
+        double seconds = 0.0; //wall time from the vertex transform to the last shaded quad
+    };
+
+    //scenes are told apart by the mean number of quads their triangles cover
+    enum JSceneClass { J_SCENE_MICRO_TRIANGLES, J_SCENE_SMALL_TRIANGLES, J_SCENE_LARGE_TRIANGLES };
+
+    /**
+     * @brief picks the batching of the frame stream from measured triangle sizes and stage timings.
+     * Cheap faces (micro triangles) are batched in large chunks with many faces in flight so that the per item
+     * overhead is amortized, expensive ones (large triangles) in small ones so that the workers stay balanced
+     */
+    class JPipelineTuner final {
+    public:
+        static constexpr int MIN_BATCH_FACES = 64;
+        static constexpr int MAX_BATCH_FACES = 8192;
+        static constexpr double TARGET_ITEM_SECONDS = 200e-6; //work of one chunk, or of the faces in flight per worker
+        static constexpr int CHUNKS_PER_WORKER = 4; //lower bound on the binning chunks for load balancing
+
+        /**
+         * @brief adapts the tuning to the stats of a rendered frame stream, the per face cost is smoothed
+         * over frames so that a single noisy frame does not flip the batch sizes
+         * @param concurrency worker threads
+         */
+        void update(const JPipelineStats& stats, const int& concurrency);
+
+        const JPipelineTuning& getTuning() const { return tuning; }
+        void setTuning(const JPipelineTuning& _tuning) { tuning = _tuning; }
+
+        static JSceneClass classify(const JPipelineStats& stats);
+        static const char* sceneClassName(const JSceneClass& sceneClass);
+        //the worker count and the SIMD kernels the library was built with
+        static string machineKey(const int& concurrency);
+
+        /**
+         * @brief calibration cache, one "machine sceneClass chunkFaces inflightFaces sortLastFaces" line per key,
+         * sortLastFaces is kept as it is for lines written before the sort-last mode
+         * @return false if path has no entry for the key
+         */
+        static bool loadCalibration(const string& path, const string& machine, const JSceneClass& sceneClass, JPipelineTuning& tuning);
+        //adds or replaces the entry of the key, returns false if path can not be written
+        static bool saveCalibration(const string& path, const string& machine, const JSceneClass& sceneClass, const JPipelineTuning& tuning);
+
+    private:
+        JPipelineTuning tuning;
+        double faceSeconds = 0.0; //smoothed cpu time per face, 0 before the first update
+    };
+}
+
+#endif //JPIPELINETUNER_H
@@ -7,6 +7,7 @@
 
 #include <array>
 #include <vector>
+#include <type_traits>
 #include "glm/glm.hpp"
 
 namespace JackalRenderer {
@@ -14,6 +15,7 @@ namespace JackalRenderer {
     class JTPixelSampler {
     public:
         std::array<T, N> samplers; //type, number
+        enum { SamplingNum = N }; //compile time sampling number, e.g. for array bounds
         static size_t getSamplingNum() { return N; }
         T& operator[](const int &index) { return samplers[index]; }
         const T& operator[](const int &index) const { return samplers[index]; }
@@ -25,7 +27,8 @@ namespace JackalRenderer {
         //assign each element in array with value
         J1PixelSampler(const T &value) { this->samplers.fill(value); }
         static const std::array<glm::vec2, 1> &getSamplingOffsets() {
-            return { glm::vec2(0.0f, 0.0f) }; //分两个三角形区域，左上和右下
+            static const std::array<glm::vec2, 1> offsets = {{ glm::vec2(0.0f, 0.0f) }}; //分两个三角形区域，左上和右下
+            return offsets;
         }
     };
 
@@ -34,7 +37,8 @@ namespace JackalRenderer {
     public:
         J2PixelSampler(const T &value) { this->samplers.fill(value); }
         static const std::array<glm::vec2, 2> &getSamplingOffsets() {
-            return { glm::vec2(-0.25f, -0.25f), glm::vec2(+0.25f, +0.25f) };
+            static const std::array<glm::vec2, 2> offsets = {{ glm::vec2(-0.25f, -0.25f), glm::vec2(+0.25f, +0.25f) }};
+            return offsets;
         }
     };
 
@@ -43,14 +47,15 @@ namespace JackalRenderer {
     public: //make sure this constructor is accessible
         J4PixelSampler(const T &value) { this->samplers.fill(value); }
         static const std::array<glm::vec2, 4> &getSamplingOffsets() {
-            return {
+            static const std::array<glm::vec2, 4> offsets = {{
                 //RGSS
                 //Refs: https://mynameismjp.wordpress.com/2012/10/24/msaa-overview/
                 glm::vec2(+0.125f, +0.375f),
                 glm::vec2(+0.375f, -0.125f),
                 glm::vec2(-0.125f, -0.375f),
                 glm::vec2(-0.375f, +0.125f)
-            };
+            }};
+            return offsets;
             // return {
             //     glm::vec2(+0.25f, +0.25f),
             //     glm::vec2(+0.25f, -0.25f),
@@ -65,40 +70,81 @@ namespace JackalRenderer {
     public:
         J8PixelSampler(const T &value) { this->samplers.fill(value); }
         static const std::array<glm::vec2, 8> &getSamplingOffsets() {
-            return{
+            static const std::array<glm::vec2, 8> offsets = {{
                 //rooks
                 glm::vec2(+0.0625f, -0.4375f),glm::vec2(+0.3125f, -0.0625f),
                 glm::vec2(+0.4375f, +0.1875f),glm::vec2(+0.1875f,+0.3125f),
                 glm::vec2(-0.0625f, +0.4375f),glm::vec2(-0.3125f, +0.0625f),
                 glm::vec2(-0.4375f, -0.1875f),glm::vec2(-0.1875f,-0.3125f)
-            };
+            }};
+            return offsets;
         }
     };
 
 #define MSAA4X
 
+    //default sampling number of a renderer, the sampling number itself is chosen at runtime, see JRenderer
 #ifdef MSAA4X
-    template<typename T>
-    using JPixelSampler = J4PixelSampler<T>;
+    constexpr int JDefaultSamplingNum = 4;
 #elif MSAA8X
-    template<typename T>
-    using JPixelSampler = J8PixelSampler<T>;
+    constexpr int JDefaultSamplingNum = 8;
 #elif MSAA2X
-    template<typename T>
-    using JPixelSampler = J2PixelSampler<T>;
+    constexpr int JDefaultSamplingNum = 2;
 #else
-    template<typename T>
-    using JPixelSampler = J1PixelSampler<T>;
+    constexpr int JDefaultSamplingNum = 1;
 #endif
+
+    //sampler of N (1, 2, 4 or 8) sampling points
+    template<typename T, int N>
+    using JPixelSamplerOf = typename std::conditional<N == 1, J1PixelSampler<T>,
+        typename std::conditional<N == 2, J2PixelSampler<T>,
+        typename std::conditional<N == 4, J4PixelSampler<T>, J8PixelSampler<T>>::type>::type>::type;
+
+    /**
+     * @brief coverage of the sampling points of one pixel as a bitmask, bit i for sampling point i.
+     * Sampler provides the sampling number and offsets.
+     */
+    template<typename Sampler>
+    class JTCoverageMask {
+    public:
+        enum { SamplingNum = Sampler::SamplingNum, FullBits = (1 << Sampler::SamplingNum) - 1 };
+        static_assert(SamplingNum <= 8, "coverage bits have to fit into one byte");
+        unsigned char bits = 0;
+
+        JTCoverageMask() = default;
+        JTCoverageMask(const unsigned int &value) : bits(static_cast<unsigned char>(value & FullBits)) {}
+        static size_t getSamplingNum() { return SamplingNum; }
+        static const std::array<glm::vec2, SamplingNum> &getSamplingOffsets() { return Sampler::getSamplingOffsets(); }
+
+        bool operator[](const int &index) const { return (bits >> index) & 1u; }
+        void set(const int &index) { bits |= static_cast<unsigned char>(1u << index); }
+        void reset(const int &index) { bits &= static_cast<unsigned char>(~(1u << index)); }
+        bool empty() const { return bits == 0; }
+        bool full() const { return bits == FullBits; }
+        int count() const {
+            //popcount of one byte
+            unsigned int c = bits - ((bits >> 1) & 0x55u);
+            c = (c & 0x33u) + ((c >> 2) & 0x33u);
+            return static_cast<int>((c + (c >> 4)) & 0x0Fu);
+        }
+        JTCoverageMask operator&(const JTCoverageMask &other) const { return JTCoverageMask(bits & other.bits); }
+        JTCoverageMask operator|(const JTCoverageMask &other) const { return JTCoverageMask(bits | other.bits); }
+        JTCoverageMask operator~() const { return JTCoverageMask(~bits); }
+        JTCoverageMask &operator&=(const JTCoverageMask &other) { bits &= other.bits; return *this; }
+        JTCoverageMask &operator|=(const JTCoverageMask &other) { bits |= other.bits; return *this; }
+    };
+
     using JPixelRGB = std::array<unsigned char, 3>; //1 byte -> max: 255
     using JPixelRGBA = std::array<unsigned char, 4>;
-    using JMaskPixelSampler = JPixelSampler<unsigned char>;
-    using JDepthPixelSampler = JPixelSampler<float>;
-    using JColorPixelSampler = JPixelSampler<JPixelRGBA>;
-    //framebuffer attachment
-    using JMaskBuffer = std::vector<JMaskPixelSampler>;
-    using JDepthBuffer = std::vector<JDepthPixelSampler>;
-    using JColorBuffer = std::vector<JColorPixelSampler>;
+    template<int N>
+    using JTMaskPixelSampler = JTCoverageMask<JPixelSamplerOf<unsigned char, N>>;
+    template<int N>
+    using JTDepthPixelSampler = JPixelSamplerOf<float, N>;
+    template<int N>
+    using JTColorPixelSampler = JPixelSamplerOf<JPixelRGBA, N>;
+    //framebuffer attachment, the sampling points of a pixel are stored next to each other
+    using JDepthBuffer = std::vector<float>;
+    using JColorBuffer = std::vector<JPixelRGBA>;
 
     constexpr JPixelRGBA jWhite = { 255, 255, 255, 255 };
     constexpr JPixelRGBA jBlack = { 0, 0, 0, 0};
@@ -0,0 +1,137 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#ifndef JQUADLANES_H
+#define JQUADLANES_H
+
+#include <algorithm>
+#include <cmath>
+#include "glm/glm.hpp"
+#include "JLight.h"
+#include "JSIMDUtils.h"
+
+/*
+ * SIMD lanes of the 4 fragments of a 2x2 quad, the packet the fragment stage shades at once (fragment p in lane p).
+ * The vector functions keep glm's operation order, so a quad shades bit for bit like four single fragments.
+ */
+namespace JackalRenderer {
+    struct QuadFloat {
+#if defined(JACKAL_SIMD_SSE2)
+        __m128 v;
+        QuadFloat() = default;
+        QuadFloat(const __m128& r) : v(r) {}
+        QuadFloat(const float& s) : v(_mm_set1_ps(s)) {}
+        QuadFloat(const float& f0, const float& f1, const float& f2, const float& f3) : v(_mm_setr_ps(f0, f1, f2, f3)) {}
+        void store(float* p) const { _mm_storeu_ps(p, v); }
+        friend QuadFloat operator+(const QuadFloat& a, const QuadFloat& b) { return _mm_add_ps(a.v, b.v); }
+        friend QuadFloat operator-(const QuadFloat& a, const QuadFloat& b) { return _mm_sub_ps(a.v, b.v); }
+        friend QuadFloat operator*(const QuadFloat& a, const QuadFloat& b) { return _mm_mul_ps(a.v, b.v); }
+        friend QuadFloat operator/(const QuadFloat& a, const QuadFloat& b) { return _mm_div_ps(a.v, b.v); }
+        friend QuadFloat operator-(const QuadFloat& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+        friend QuadFloat lanesSqrt(const QuadFloat& a) { return _mm_sqrt_ps(a.v); }
+        //glm::max(a, b) is a < b ? b : a and glm::min(a, b) is b < a ? b : a, the swapped operands keep their results for NaNs
+        friend QuadFloat lanesMax(const QuadFloat& a, const QuadFloat& b) { return _mm_max_ps(b.v, a.v); }
+        friend QuadFloat lanesMin(const QuadFloat& a, const QuadFloat& b) { return _mm_min_ps(b.v, a.v); }
+#else
+        float v[4];
+        QuadFloat() = default;
+        QuadFloat(const float& s) : v{s, s, s, s} {}
+        QuadFloat(const float& f0, const float& f1, const float& f2, const float& f3) : v{f0, f1, f2, f3} {}
+        void store(float* p) const { std::copy(v, v + 4, p); }
+        friend QuadFloat operator+(const QuadFloat& a, const QuadFloat& b) { return QuadFloat(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]); }
+        friend QuadFloat operator-(const QuadFloat& a, const QuadFloat& b) { return QuadFloat(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]); }
+        friend QuadFloat operator*(const QuadFloat& a, const QuadFloat& b) { return QuadFloat(a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]); }
+        friend QuadFloat operator/(const QuadFloat& a, const QuadFloat& b) { return QuadFloat(a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]); }
+        friend QuadFloat operator-(const QuadFloat& a) { return QuadFloat(-a.v[0], -a.v[1], -a.v[2], -a.v[3]); }
+        friend QuadFloat lanesSqrt(const QuadFloat& a) { return QuadFloat(std::sqrt(a.v[0]), std::sqrt(a.v[1]), std::sqrt(a.v[2]), std::sqrt(a.v[3])); }
+        friend QuadFloat lanesMax(const QuadFloat& a, const QuadFloat& b) {
+            return QuadFloat(glm::max(a.v[0], b.v[0]), glm::max(a.v[1], b.v[1]), glm::max(a.v[2], b.v[2]), glm::max(a.v[3], b.v[3]));
+        }
+        friend QuadFloat lanesMin(const QuadFloat& a, const QuadFloat& b) {
+            return QuadFloat(glm::min(a.v[0], b.v[0]), glm::min(a.v[1], b.v[1]), glm::min(a.v[2], b.v[2]), glm::min(a.v[3], b.v[3]));
+        }
+#endif
+        //std::pow and std::exp have no SIMD counterparts, they are evaluated lane by lane
+        friend QuadFloat lanesPow(const QuadFloat& a, const QuadFloat& e) {
+            float l[4], k[4];
+            a.store(l);
+            e.store(k);
+            return QuadFloat(std::pow(l[0], k[0]), std::pow(l[1], k[1]), std::pow(l[2], k[2]), std::pow(l[3], k[3]));
+        }
+        friend QuadFloat lanesExp(const QuadFloat& a) {
+            float l[4];
+            a.store(l);
+            return QuadFloat(std::exp(l[0]), std::exp(l[1]), std::exp(l[2]), std::exp(l[3]));
+        }
+    };
+
+    struct QuadVec2 {
+        QuadFloat x, y;
+        QuadVec2() = default;
+        QuadVec2(const QuadFloat& _x, const QuadFloat& _y) : x(_x), y(_y) {}
+        QuadVec2(const glm::vec2& v) : x(v.x), y(v.y) {}
+        QuadVec2(const glm::vec2 v[4]) : x(v[0].x, v[1].x, v[2].x, v[3].x), y(v[0].y, v[1].y, v[2].y, v[3].y) {}
+        friend QuadVec2 operator+(const QuadVec2& a, const QuadVec2& b) { return QuadVec2(a.x + b.x, a.y + b.y); }
+        friend QuadVec2 operator-(const QuadVec2& a, const QuadVec2& b) { return QuadVec2(a.x - b.x, a.y - b.y); }
+        friend QuadVec2 operator*(const QuadVec2& a, const QuadVec2& b) { return QuadVec2(a.x * b.x, a.y * b.y); }
+        friend QuadVec2 operator*(const QuadVec2& a, const QuadFloat& s) { return QuadVec2(a.x * s, a.y * s); }
+        friend QuadVec2 operator*(const QuadFloat& s, const QuadVec2& a) { return QuadVec2(s * a.x, s * a.y); }
+        friend QuadVec2 operator/(const QuadVec2& a, const QuadFloat& s) { return QuadVec2(a.x / s, a.y / s); }
+    };
+
+    struct QuadVec3 {
+        QuadFloat x, y, z;
+        QuadVec3() = default;
+        QuadVec3(const QuadFloat& _x, const QuadFloat& _y, const QuadFloat& _z) : x(_x), y(_y), z(_z) {}
+        QuadVec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+        QuadVec3(const glm::vec3 v[4])
+            : x(v[0].x, v[1].x, v[2].x, v[3].x), y(v[0].y, v[1].y, v[2].y, v[3].y), z(v[0].z, v[1].z, v[2].z, v[3].z) {}
+        friend QuadVec3 operator+(const QuadVec3& a, const QuadVec3& b) { return QuadVec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+        friend QuadVec3 operator-(const QuadVec3& a, const QuadVec3& b) { return QuadVec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+        friend QuadVec3 operator*(const QuadVec3& a, const QuadVec3& b) { return QuadVec3(a.x * b.x, a.y * b.y, a.z * b.z); }
+        friend QuadVec3 operator*(const QuadVec3& a, const QuadFloat& s) { return QuadVec3(a.x * s, a.y * s, a.z * s); }
+        friend QuadVec3 operator*(const QuadFloat& s, const QuadVec3& a) { return QuadVec3(s * a.x, s * a.y, s * a.z); }
+        friend QuadVec3 operator/(const QuadVec3& a, const QuadFloat& s) { return QuadVec3(a.x / s, a.y / s, a.z / s); }
+        friend QuadVec3 operator-(const QuadVec3& a) { return QuadVec3(-a.x, -a.y, -a.z); }
+    };
+
+    struct QuadVec4 {
+        QuadFloat x, y, z, w;
+        QuadVec4() = default;
+        QuadVec4(const QuadFloat& _x, const QuadFloat& _y, const QuadFloat& _z, const QuadFloat& _w) : x(_x), y(_y), z(_z), w(_w) {}
+        QuadVec4(const QuadVec3& v, const QuadFloat& _w) : x(v.x), y(v.y), z(v.z), w(_w) {}
+        QuadVec4(const glm::vec4& v) : x(v.x), y(v.y), z(v.z), w(v.w) {}
+        QuadVec4(const glm::vec4 v[4])
+            : x(v[0].x, v[1].x, v[2].x, v[3].x), y(v[0].y, v[1].y, v[2].y, v[3].y),
+              z(v[0].z, v[1].z, v[2].z, v[3].z), w(v[0].w, v[1].w, v[2].w, v[3].w) {}
+        QuadVec3 xyz() const { return QuadVec3(x, y, z); }
+        friend QuadVec4 operator+(const QuadVec4& a, const QuadVec4& b) { return QuadVec4(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w); }
+        friend QuadVec4 operator-(const QuadVec4& a, const QuadVec4& b) { return QuadVec4(a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w); }
+        friend QuadVec4 operator*(const QuadVec4& a, const QuadVec4& b) { return QuadVec4(a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w); }
+        friend QuadVec4 operator*(const QuadVec4& a, const QuadFloat& s) { return QuadVec4(a.x * s, a.y * s, a.z * s, a.w * s); }
+        friend QuadVec4 operator*(const QuadFloat& s, const QuadVec4& a) { return QuadVec4(s * a.x, s * a.y, s * a.z, s * a.w); }
+        friend QuadVec4 operator/(const QuadVec4& a, const QuadFloat& s) { return QuadVec4(a.x / s, a.y / s, a.z / s, a.w / s); }
+    };
+
+    //the operation orders of glm's dot, normalize and reflect
+    inline QuadFloat dot(const QuadVec3& a, const QuadVec3& b) { return (a.x * b.x + a.y * b.y) + a.z * b.z; }
+    inline QuadVec3 normalize(const QuadVec3& v) { return v * (QuadFloat(1.0f) / lanesSqrt(dot(v, v))); }
+    inline QuadVec3 reflect(const QuadVec3& i, const QuadVec3& n) { return i - n * dot(n, i) * QuadFloat(2.0f); }
+
+    //direction, attenuation and cutoff of a light for the fragments of a quad, JLight evaluates one fragment per call
+    inline void evaluateQuadLight(const JLight& light, const glm::vec3 fragPos[4], QuadVec3& lightDir, QuadFloat& attenuation, QuadFloat& cutoff) {
+        glm::vec3 dir[4];
+        float att[4], cut[4];
+        for(int p = 0; p < 4; ++p) {
+            dir[p] = light.direction(fragPos[p]);
+            att[p] = light.attenuation(fragPos[p]);
+            cut[p] = light.cutoff(dir[p]);
+        }
+        lightDir = QuadVec3(dir);
+        attenuation = QuadFloat(att[0], att[1], att[2], att[3]);
+        cutoff = QuadFloat(cut[0], cut[1], cut[2], cut[3]);
+    }
+}
+
+#endif //JQUADLANES_H
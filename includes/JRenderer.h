@@ -12,6 +12,7 @@
 #include "JDrawableMesh.h"
 #include "JShadingPipeline.h"
 #include "JShadingState.h"
+#include "JPipelineTuner.h"
 
 using std::vector;
 using std::shared_ptr;
@@ -20,11 +21,21 @@ using std::array;
 using uchar = unsigned char;
 
 namespace JackalRenderer {
+    class FramebufferMutex;
+    class TileBinner;
+    class SortLastBuffers;
+    class RasterBuffers;
+    class FrameStream;
+
     class JRenderer final {
     public:
         using ptr = shared_ptr<JRenderer>;
 
-        JRenderer(int width, int height);
+        /**
+         * @param samplingNum MSAA sampling points per pixel, 1, 2, 4 or 8. A lower number trades edge quality
+         * for less framebuffer memory and fewer depth tests, e.g. for previews
+         */
+        JRenderer(int width, int height, int samplingNum = JDefaultSamplingNum);
         ~JRenderer() = default;
 
         void addDrawableMesh(JDrawableMesh::ptr mesh);
@@ -42,6 +53,49 @@ namespace JackalRenderer {
             frustumNearFar = glm::vec2(near, far);
         }
         void setShaderPipeline(const JShadingPipeline::ptr& shader) { shaderHandler = shader; }
+        /**
+         * @brief can be switched between frames. J_RASTER_SORT_LAST keeps a full framebuffer per worker thread, draws that
+         * blend, skip the depth test or the depth write, or fill the G-buffer are tile binned in that mode
+         */
+        void setRasterParallelMode(JRasterParallelMode mode) { raster_parallel_mode_ = mode; }
+        JRasterParallelMode getRasterParallelMode() const { return raster_parallel_mode_; }
+        /**
+         * @brief J_SHADING_DEFERRED renders the opaque meshes into a G-buffer and lights every visible pixel once,
+         * alpha blended meshes are shaded forward on top. Only takes effect for deferrable shading pipelines,
+         * see JShadingPipeline::isDeferrable
+         */
+        void setShadingMode(JShadingMode mode) { shading_mode_ = mode; }
+        JShadingMode getShadingMode() const { return shading_mode_; }
+        /**
+         * @brief renders the depth of the opaque meshes first, without shading, and then shades them with depth-equal
+         * testing so that every visible sample is shaded once. Skipped for pipelines that need late depth testing
+         */
+        void setDepthPrepass(bool enable) { depth_prepass_ = enable; }
+        bool isDepthPrepassEnabled() const { return depth_prepass_; }
+        //batching of the frame stream, see JPipelineTuning
+        void setPipelineTuning(const JPipelineTuning& tuning) { pipeline_tuner_.setTuning(tuning); }
+        const JPipelineTuning& getPipelineTuning() const { return pipeline_tuner_.getTuning(); }
+        //re-tunes the batching after every frame from its measured triangle sizes and timings, see JPipelineTuner
+        void setAdaptivePipelineTuning(bool enable) { adaptive_tuning_ = enable; }
+        bool isAdaptivePipelineTuningEnabled() const { return adaptive_tuning_; }
+        //triangles, quads and time of the last frame
+        const JPipelineStats& getPipelineStats() const { return frame_stats_; }
+        /**
+         * @brief calibration mode, renders the drawable meshes with every power of two batch size in
+         * [MIN_BATCH_FACES, MAX_BATCH_FACES] of each raster parallel mode and keeps the fastest batch size per mode.
+         * The raster parallel mode itself stays as set, the calibration tunes whichever mode is picked.
+         * The result is stored in cachePath per machine and scene class, later runs with the
+         * same cache only render one frame to classify the scene. Overwrites the frame buffers, call before rendering
+         * @param frames rendered per batching, the fastest one counts
+         * @return true if the tuning was read from the cache
+         */
+        bool calibratePipeline(const string& cachePath, int frames = 2);
+        //fractional bits vertices are snapped to before rasterization, 0 snaps to whole pixels
+        void setSubpixelPrecision(int bits) { subpixel_bits_ = glm::clamp(bits, 0, (int)JShadingPipeline::SUBPIXEL_BITS); }
+        int getSubpixelPrecision() const { return subpixel_bits_; }
+        //recreates the render targets with samplingNum (1, 2, 4 or 8) sampling points per pixel
+        void setSamplingNum(int samplingNum);
+        int getSamplingNum() const { return backBuffer -> getSamplingNum(); }
         void setViewerPos(const glm::vec3 &viewer);
 
         int addLightSource(JLight::ptr lightSource);
@@ -50,22 +104,55 @@ namespace JackalRenderer {
 
         uint renderAllDrawableMeshes();
 
+        //renders one mesh on its own with the current lights, renderAllDrawableMeshes renders the meshes of a pass together
         uint renderAllDrawableMesh(const size_t& idx);
 
         uchar* commitRenderedColorBuffer();
 
-        static vector<JShadingPipeline::VertexData> clipingSutherlandHodgeman(
+        //clip space polygon of fixed capacity, each clipping plane adds at most one vertex to it
+        struct ClipPolygon {
+            static constexpr int MAX_VERTICES = 3 + 7; //triangle + near, far, w and the four guard band planes
+            JShadingPipeline::VertexData vertices[MAX_VERTICES];
+            int num = 0;
+        };
+
+        /**
+         * @brief guard band clipping, only the near/far (z) and w planes clip for real. x/y outside the view volume
+         * are left to the rasterizer, which clamps to the screen, the guard band planes only clip triangles reaching
+         * so far out that their fixed point screen positions could overflow
+         * @return number of vertices of the clipped polygon, 0 if the triangle is outside
+         */
+        static int clipingSutherlandHodgeman(
             const JShadingPipeline::VertexData& v0,
             const JShadingPipeline::VertexData& v1,
             const JShadingPipeline::VertexData& v2,
             const float& near,
-            const float& far);
+            const float& far,
+            ClipPolygon& polygon);
 
     private:
-        static vector<JShadingPipeline::VertexData> clipingSutherlandHodgemanAux(
-            const vector<JShadingPipeline::VertexData>& polygon,
-            const int& axis,
-            const int& side);
+        //per frame setup of both entry points: the default shader, the view projection, the compiled lights and the stats
+        void beginFrame();
+        //appends the submeshes of a mesh to the frame stream with the current state, returns their triangles
+        uint recordDrawableMesh(const size_t& idx);
+        //renders and clears the frame stream
+        void renderFrameStream();
+        template<int N>
+        void renderFrameStream();
+        //the lighting pass of deferred shading, the G-buffer of the back buffer into its color buffer
+        template<int N>
+        void lightGBuffer();
+        //opaque meshes that test and write depth take part in the depth prepass
+        bool isDepthPrepassMesh(const size_t& idx) const;
+        //meshes with J_ALPHA_ORDER_INDEPENDENT are rendered after all others, in a pass of their own
+        bool isOrderIndependentMesh(const size_t& idx) const;
+
+        //keeps the part of polygon with dot(plane, cpos) + offset >= 0
+        static void clipingSutherlandHodgemanAux(
+            const ClipPolygon& polygon,
+            const glm::vec4& plane,
+            const float& offset,
+            ClipPolygon& insidePolygon);
 
     private:
         vector<JDrawableMesh::ptr> drawable_meshes_;
@@ -75,6 +162,23 @@ namespace JackalRenderer {
         glm::mat4 viewport_Matrix = glm::mat4(1.0f); //ndc space -> screen space
 
         JShadingState shading_state_;
+        JRasterParallelMode raster_parallel_mode_ = JRasterParallelMode::J_RASTER_TILE_BINNING;
+        JShadingMode shading_mode_ = JShadingMode::J_SHADING_FORWARD;
+        bool geometry_pass_ = false; //drawcalls write the G-buffer instead of colors
+        bool depth_prepass_ = false;
+        bool depth_only_pass_ = false; //drawcalls only write depth
+        bool depth_prepassed_ = false; //the depth of the opaque meshes of this frame is already in the back buffer
+        shared_ptr<FramebufferMutex> framebuffer_mutex_ = nullptr; //per-pixel locks, only for J_RASTER_PIXEL_LOCK
+        shared_ptr<TileBinner> tile_binner_ = nullptr;
+        shared_ptr<SortLastBuffers> sort_last_buffers_ = nullptr; //private framebuffers of the workers, only for J_RASTER_SORT_LAST
+        shared_ptr<RasterBuffers> raster_buffers_ = nullptr; //fragment cache and quad records per sampling number
+        shared_ptr<FrameStream> frame_stream_ = nullptr; //draws recorded for the current pass
+        bool handler_draws_pending_ = false; //the frame stream holds draws of shaderHandler itself, which can not be cloned
+        bool clone_warned_ = false;
+        JPipelineTuner pipeline_tuner_;
+        bool adaptive_tuning_ = false;
+        JPipelineStats frame_stats_; //summed over the frame streams of the last frame
+        int subpixel_bits_ = JShadingPipeline::SUBPIXEL_BITS;
 
         glm::vec2 frustumNearFar;
 
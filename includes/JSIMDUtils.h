@@ -0,0 +1,26 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#ifndef JSIMDUTILS_H
+#define JSIMDUTILS_H
+
+/*
+ * x86 SIMD selection for the hot kernels.
+ * SSE2 is part of x86-64 (and of MSVC x64 builds), AVX2 needs /arch:AVX2 or -mavx2, see JACKAL_ENABLE_AVX2 in CMakeLists.txt.
+ * Every kernel keeps a scalar fallback for other architectures.
+ */
+#if defined(__AVX2__)
+    #define JACKAL_SIMD_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define JACKAL_SIMD_SSE2
+#endif
+
+#if defined(JACKAL_SIMD_AVX2)
+    #include <immintrin.h>
+#elif defined(JACKAL_SIMD_SSE2)
+    #include <emmintrin.h>
+#endif
+
+#endif //JSIMDUTILS_H
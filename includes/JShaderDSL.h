@@ -0,0 +1,377 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#ifndef JSHADERDSL_H
+#define JSHADERDSL_H
+
+#include <memory>
+#include <utility>
+#include "JShaderProgram.h"
+#include "JQuadLanes.h"
+
+/*
+ * Header-only shader DSL. A fragment shader is written as one expression of varyings, material uniforms,
+ * textures and a light loop, e.g. Lambert:
+ *
+ *     using namespace JackalRenderer::ShaderDSL;
+ *     auto albedo = textureOr(J_DIFFUSE_MAP, texcoord(), vec4(diffuseCoef(), 1.0f));
+ *     auto lit = lightSum(lightIntensity() * max(dot(normalize(normal()), lightDirection()), 0.0f) * rgb(albedo)
+ *         * lightAttenuation() * lightCutoff());
+ *     renderer -> setShaderPipeline(makeShadingPipeline(vec4(lit + emissionColor(), alpha(albedo) * transparency())));
+ *
+ * The expression types are resolved at compile time into a kernel over the SIMD lanes of a quad (JQuadLanes.h),
+ * which JDSLShadingPipeline plugs into fragmentShaderQuad. Subexpressions are evaluated where they are used, a
+ * subexpression used twice is evaluated twice unless the compiler folds it.
+ */
+namespace JackalRenderer {
+    namespace ShaderDSL {
+        enum JTextureSlot { J_DIFFUSE_MAP, J_SPECULAR_MAP, J_NORMAL_MAP, J_GLOW_MAP };
+
+        //everything an expression is evaluated against, filled per quad by JDSLShadingPipeline
+        struct QuadContext {
+            const JShadingPipeline::QuadFragments* quad = nullptr;
+            unsigned int activeMask = 0;
+            //varyings, helper lanes repeat the first active fragment
+            glm::vec3 fragPos[4];
+            glm::vec2 fragTex[4];
+            QuadVec3 pos;
+            QuadVec3 nor;
+            QuadVec2 tex;
+            glm::mat3 tbn[4];
+            //material and scene uniforms
+            glm::vec3 kA, kD, kS, kE;
+            float shininess;
+            float transparency;
+            float exposure;
+            glm::vec3 viewerPos;
+            int textureIds[4]; //indexed by JTextureSlot
+            const JLightTable* lightTable = nullptr;
+            //the light of the current lightSum iteration
+            mutable QuadVec3 lightDir;
+            mutable QuadVec3 lightIntensity;
+            mutable QuadFloat lightAttenuation;
+            mutable QuadFloat lightCutoff;
+        };
+
+        //CRTP base of all expressions, E::eval(const QuadContext&) returns QuadFloat, QuadVec2, QuadVec3 or QuadVec4
+        template<typename E>
+        struct Expr {
+            const E& self() const { return static_cast<const E&>(*this); }
+        };
+
+        template<typename E>
+        using LanesOf = decltype(std::declval<const E&>().eval(std::declval<const QuadContext&>()));
+
+        //constant of the expression, broadcast to all lanes
+        template<typename T>
+        struct UniformExpr : Expr<UniformExpr<T>> {
+            T value;
+            explicit UniformExpr(const T& v) : value(v) {}
+            T eval(const QuadContext&) const { return value; }
+        };
+
+        //reads a member of the context, the varyings, material uniforms and light values
+        template<typename T, T QuadContext::*Member>
+        struct ContextExpr : Expr<ContextExpr<T, Member>> {
+            T eval(const QuadContext& c) const { return c.*Member; }
+        };
+
+        //a glm member of the context, broadcast to all lanes
+        template<glm::vec3 QuadContext::*Member>
+        struct ContextVec3Expr : Expr<ContextVec3Expr<Member>> {
+            QuadVec3 eval(const QuadContext& c) const { return QuadVec3(c.*Member); }
+        };
+
+        template<float QuadContext::*Member>
+        struct ContextFloatExpr : Expr<ContextFloatExpr<Member>> {
+            QuadFloat eval(const QuadContext& c) const { return QuadFloat(c.*Member); }
+        };
+
+        template<typename Op, typename A, typename B>
+        struct BinaryExpr : Expr<BinaryExpr<Op, A, B>> {
+            A a;
+            B b;
+            BinaryExpr(const A& _a, const B& _b) : a(_a), b(_b) {}
+            auto eval(const QuadContext& c) const -> decltype(Op::apply(std::declval<LanesOf<A>>(), std::declval<LanesOf<B>>())) {
+                return Op::apply(a.eval(c), b.eval(c));
+            }
+        };
+
+        template<typename Op, typename A>
+        struct UnaryExpr : Expr<UnaryExpr<Op, A>> {
+            A a;
+            explicit UnaryExpr(const A& _a) : a(_a) {}
+            auto eval(const QuadContext& c) const -> decltype(Op::apply(std::declval<LanesOf<A>>())) {
+                return Op::apply(a.eval(c));
+            }
+        };
+
+        struct AddOp { template<typename X, typename Y> static auto apply(const X& x, const Y& y) -> decltype(x + y) { return x + y; } };
+        struct SubOp { template<typename X, typename Y> static auto apply(const X& x, const Y& y) -> decltype(x - y) { return x - y; } };
+        struct MulOp { template<typename X, typename Y> static auto apply(const X& x, const Y& y) -> decltype(x * y) { return x * y; } };
+        struct DivOp { template<typename X, typename Y> static auto apply(const X& x, const Y& y) -> decltype(x / y) { return x / y; } };
+        struct DotOp { static QuadFloat apply(const QuadVec3& x, const QuadVec3& y) { return JackalRenderer::dot(x, y); } };
+        struct ReflectOp { static QuadVec3 apply(const QuadVec3& x, const QuadVec3& y) { return JackalRenderer::reflect(x, y); } };
+        struct MaxOp { static QuadFloat apply(const QuadFloat& x, const QuadFloat& y) { return lanesMax(x, y); } };
+        struct MinOp { static QuadFloat apply(const QuadFloat& x, const QuadFloat& y) { return lanesMin(x, y); } };
+        struct PowOp { static QuadFloat apply(const QuadFloat& x, const QuadFloat& y) { return lanesPow(x, y); } };
+        struct Vec4Op { static QuadVec4 apply(const QuadVec3& x, const QuadFloat& y) { return QuadVec4(x, y); } };
+        struct NegateOp { template<typename X> static auto apply(const X& x) -> decltype(-x) { return -x; } };
+        struct NormalizeOp { static QuadVec3 apply(const QuadVec3& x) { return JackalRenderer::normalize(x); } };
+        struct SqrtOp { static QuadFloat apply(const QuadFloat& x) { return lanesSqrt(x); } };
+        struct ExpOp { static QuadFloat apply(const QuadFloat& x) { return lanesExp(x); } };
+        struct RgbOp { static QuadVec3 apply(const QuadVec4& x) { return x.xyz(); } };
+        struct AlphaOp { static QuadFloat apply(const QuadVec4& x) { return x.w; } };
+
+        //operands of the operators and functions, plain floats and glm vectors become uniforms
+        template<typename E>
+        inline const E& expr(const Expr<E>& e) { return e.self(); }
+        inline UniformExpr<QuadFloat> expr(const float& v) { return UniformExpr<QuadFloat>(QuadFloat(v)); }
+        inline UniformExpr<QuadVec3> expr(const glm::vec3& v) { return UniformExpr<QuadVec3>(QuadVec3(v)); }
+        inline UniformExpr<QuadVec4> expr(const glm::vec4& v) { return UniformExpr<QuadVec4>(QuadVec4(v)); }
+
+        template<typename T>
+        using ExprOf = typename std::decay<decltype(expr(std::declval<const T&>()))>::type;
+
+        //true if T is an expression, the operators below only take part in overload resolution for them
+        template<typename T>
+        struct IsExpr : std::is_base_of<Expr<T>, T> {};
+
+        template<typename A, typename B>
+        using EnableIfExpr = typename std::enable_if<IsExpr<A>::value || IsExpr<B>::value>::type;
+
+#define JACKAL_DSL_BINARY(name, Op)                                                                   \
+        template<typename A, typename B, typename = EnableIfExpr<A, B>>                             \
+        inline BinaryExpr<Op, ExprOf<A>, ExprOf<B>> name(const A& a, const B& b) {                  \
+            return BinaryExpr<Op, ExprOf<A>, ExprOf<B>>(expr(a), expr(b));                           \
+        }
+
+        JACKAL_DSL_BINARY(operator+, AddOp)
+        JACKAL_DSL_BINARY(operator-, SubOp)
+        JACKAL_DSL_BINARY(operator*, MulOp)
+        JACKAL_DSL_BINARY(operator/, DivOp)
+        JACKAL_DSL_BINARY(dot, DotOp)
+        JACKAL_DSL_BINARY(reflect, ReflectOp)
+        JACKAL_DSL_BINARY(max, MaxOp)
+        JACKAL_DSL_BINARY(min, MinOp)
+        JACKAL_DSL_BINARY(pow, PowOp)
+        JACKAL_DSL_BINARY(vec4, Vec4Op)
+#undef JACKAL_DSL_BINARY
+
+        template<typename A>
+        inline UnaryExpr<NegateOp, A> operator-(const Expr<A>& a) { return UnaryExpr<NegateOp, A>(a.self()); }
+        template<typename A>
+        inline UnaryExpr<NormalizeOp, A> normalize(const Expr<A>& a) { return UnaryExpr<NormalizeOp, A>(a.self()); }
+        template<typename A>
+        inline UnaryExpr<SqrtOp, A> sqrt(const Expr<A>& a) { return UnaryExpr<SqrtOp, A>(a.self()); }
+        template<typename A>
+        inline UnaryExpr<ExpOp, A> exp(const Expr<A>& a) { return UnaryExpr<ExpOp, A>(a.self()); }
+        template<typename A>
+        inline UnaryExpr<RgbOp, A> rgb(const Expr<A>& a) { return UnaryExpr<RgbOp, A>(a.self()); }
+        template<typename A>
+        inline UnaryExpr<AlphaOp, A> alpha(const Expr<A>& a) { return UnaryExpr<AlphaOp, A>(a.self()); }
+        //glm::clamp, min(max(x, lo), hi)
+        template<typename A, typename L, typename H>
+        inline auto clamp(const Expr<A>& x, const L& lo, const H& hi) -> decltype(min(max(x.self(), lo), hi)) {
+            return min(max(x.self(), lo), hi);
+        }
+
+        //varyings, perspective corrected world position, interpolated normal and texture coordinates
+        inline ContextExpr<QuadVec3, &QuadContext::pos> position() { return {}; }
+        inline ContextExpr<QuadVec3, &QuadContext::nor> normal() { return {}; }
+        inline ContextExpr<QuadVec2, &QuadContext::tex> texcoord() { return {}; }
+
+        //uniforms of the material of the drawn submesh and of the scene
+        inline ContextVec3Expr<&QuadContext::kA> ambientCoef() { return {}; }
+        inline ContextVec3Expr<&QuadContext::kD> diffuseCoef() { return {}; }
+        inline ContextVec3Expr<&QuadContext::kS> specularCoef() { return {}; }
+        inline ContextVec3Expr<&QuadContext::kE> emissionColor() { return {}; }
+        inline ContextVec3Expr<&QuadContext::viewerPos> viewerPosition() { return {}; }
+        inline ContextFloatExpr<&QuadContext::shininess> shininess() { return {}; }
+        inline ContextFloatExpr<&QuadContext::transparency> transparency() { return {}; }
+        inline ContextFloatExpr<&QuadContext::exposure> exposure() { return {}; }
+        template<typename T>
+        inline ExprOf<T> uniform(const T& value) { return expr(value); }
+
+        //values of the current light, only valid inside lightSum
+        inline ContextExpr<QuadVec3, &QuadContext::lightDir> lightDirection() { return {}; }
+        inline ContextExpr<QuadVec3, &QuadContext::lightIntensity> lightIntensity() { return {}; }
+        inline ContextExpr<QuadFloat, &QuadContext::lightAttenuation> lightAttenuation() { return {}; }
+        inline ContextExpr<QuadFloat, &QuadContext::lightCutoff> lightCutoff() { return {}; }
+
+        /**
+         * @brief samples the texture of slot at uv for every active lane, with the LOD of the quad's uv derivatives.
+         * Materials without a texture in slot take fallback instead, the choice is made once per quad
+         */
+        template<typename UV, typename F>
+        struct TextureExpr : Expr<TextureExpr<UV, F>> {
+            JTextureSlot slot;
+            UV uv;
+            F fallback;
+            TextureExpr(const JTextureSlot& s, const UV& _uv, const F& f) : slot(s), uv(_uv), fallback(f) {}
+            QuadVec4 eval(const QuadContext& c) const {
+                const int id = c.textureIds[slot];
+                if(id == -1)
+                    return fallback.eval(c);
+                const float lod = JShadingPipeline::textureLod(id, c.quad -> dUVdx, c.quad -> dUVdy);
+                const QuadVec2 coords = uv.eval(c);
+                float u[4], v[4];
+                coords.x.store(u);
+                coords.y.store(v);
+                glm::vec4 texel[4];
+                int first = -1;
+                for(int p = 0; p < 4; ++p) {
+                    if(!(c.activeMask & (1u << p)))
+                        continue;
+                    texel[p] = JShadingPipeline::texture2DLod(id, glm::vec2(u[p], v[p]), lod);
+                    first = first == -1 ? p : first;
+                }
+                for(int p = 0; p < 4; ++p) {
+                    if(!(c.activeMask & (1u << p)))
+                        texel[p] = texel[first];
+                }
+                return QuadVec4(texel);
+            }
+        };
+
+        template<typename UV, typename F>
+        inline TextureExpr<ExprOf<UV>, ExprOf<F>> textureOr(const JTextureSlot& slot, const UV& uv, const F& fallback) {
+            return TextureExpr<ExprOf<UV>, ExprOf<F>>(slot, expr(uv), expr(fallback));
+        }
+        //a missing texture reads 0 like texture2D
+        template<typename UV>
+        inline TextureExpr<ExprOf<UV>, UniformExpr<QuadVec4>> texture2D(const JTextureSlot& slot, const UV& uv) {
+            return textureOr(slot, uv, glm::vec4(0.0f));
+        }
+
+        //tangent space normal of the normal map turned into world space, the interpolated normal without a normal map
+        struct NormalMapExpr : Expr<NormalMapExpr> {
+            QuadVec3 eval(const QuadContext& c) const {
+                const int id = c.textureIds[J_NORMAL_MAP];
+                if(id == -1)
+                    return c.nor;
+                const float lod = JShadingPipeline::textureLod(id, c.quad -> dUVdx, c.quad -> dUVdy);
+                glm::vec3 nor[4];
+                for(int p = 0; p < 4; ++p)
+                    nor[p] = c.tbn[p] * (glm::vec3(JShadingPipeline::texture2DLod(id, c.fragTex[p], lod)) * 2.0f - glm::vec3(1.0f));
+                return QuadVec3(nor);
+            }
+        };
+        inline NormalMapExpr mappedNormal() { return {}; }
+
+        //the sum of body over the lights of the quad's clusters, body reads the light through lightDirection() and the like
+        template<typename Body>
+        struct LightSumExpr : Expr<LightSumExpr<Body>> {
+            Body body;
+            explicit LightSumExpr(const Body& b) : body(b) {}
+            LanesOf<Body> eval(const QuadContext& c) const {
+                LanesOf<Body> sum = zero(static_cast<LanesOf<Body>*>(nullptr));
+                JShadingPipeline::forEachQuadLight(*c.quad, c.fragPos, c.pos, [&](const size_t& i, const QuadVec3& lightDir,
+                    const QuadFloat& attenuation, const QuadFloat& cutoff) {
+                    c.lightDir = lightDir;
+                    c.lightAttenuation = attenuation;
+                    c.lightCutoff = cutoff;
+                    c.lightIntensity = QuadVec3(c.lightTable -> intensity[i]);
+                    sum = sum + body.eval(c);
+                });
+                return sum;
+            }
+        private:
+            static QuadFloat zero(QuadFloat*) { return QuadFloat(0.0f); }
+            static QuadVec3 zero(QuadVec3*) { return QuadVec3(glm::vec3(0.0f)); }
+            static QuadVec4 zero(QuadVec4*) { return QuadVec4(glm::vec4(0.0f)); }
+        };
+
+        template<typename A>
+        inline LightSumExpr<A> lightSum(const Expr<A>& body) { return LightSumExpr<A>(body.self()); }
+    }
+
+    /**
+     * @brief shading pipeline of a ShaderDSL color expression (a QuadVec4 expression, rgba), vertices are shaded
+     * like J3DShadingPipeline. The expression is evaluated for the 4 fragments of a quad at once
+     */
+    template<typename ColorExpr>
+    class JDSLShadingPipeline final : public J3DShadingPipeline {
+    public:
+        using ptr = shared_ptr<JDSLShadingPipeline>;
+
+        explicit JDSLShadingPipeline(const ColorExpr& color) : colorExpr(color) {}
+        virtual ~JDSLShadingPipeline() = default;
+        virtual JShadingPipeline::ptr clone() const override { return std::make_shared<JDSLShadingPipeline>(*this); }
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
+
+        virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override {
+            QuadFragments quad;
+            quad.fragments[0] = data;
+            quad.dUVdx = dUVdx;
+            quad.dUVdy = dUVdy;
+            glm::vec4 fragColors[4];
+            fragmentShaderQuad(quad, 1u, fragColors);
+            fragColor = fragColors[0];
+        }
+
+        virtual void fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const override {
+            ShaderDSL::QuadContext c;
+            c.quad = &quad;
+            c.activeMask = activeMask;
+            glm::vec3 nor[4];
+            int first = -1;
+            for(int p = 0; p < 4; ++p) {
+                if(!(activeMask & (1u << p)))
+                    continue;
+                first = first == -1 ? p : first;
+                c.fragPos[p] = quad.fragments[p].pos;
+                c.fragTex[p] = quad.fragments[p].tex;
+                c.tbn[p] = quad.fragments[p].tbn;
+                nor[p] = quad.fragments[p].nor;
+            }
+            for(int p = 0; p < 4; ++p) {
+                if(activeMask & (1u << p))
+                    continue;
+                c.fragPos[p] = c.fragPos[first];
+                c.fragTex[p] = c.fragTex[first];
+                c.tbn[p] = c.tbn[first];
+                nor[p] = nor[first];
+            }
+            c.pos = QuadVec3(c.fragPos);
+            c.nor = QuadVec3(nor);
+            c.tex = QuadVec2(c.fragTex);
+            c.kA = kA;
+            c.kD = kD;
+            c.kS = kS;
+            c.kE = kE;
+            c.shininess = shininess;
+            c.transparency = transparency;
+            c.exposure = exposure;
+            c.viewerPos = viewerPos;
+            c.textureIds[ShaderDSL::J_DIFFUSE_MAP] = diffuseTexId;
+            c.textureIds[ShaderDSL::J_SPECULAR_MAP] = specularTexId;
+            c.textureIds[ShaderDSL::J_NORMAL_MAP] = normalTexId;
+            c.textureIds[ShaderDSL::J_GLOW_MAP] = glowTexId;
+            c.lightTable = &lightTable;
+
+            const QuadVec4 color = colorExpr.eval(c);
+            float r[4], g[4], b[4], a[4];
+            color.x.store(r);
+            color.y.store(g);
+            color.z.store(b);
+            color.w.store(a);
+            for(int p = 0; p < 4; ++p) {
+                if(activeMask & (1u << p))
+                    fragColors[p] = glm::vec4(r[p], g[p], b[p], a[p]);
+            }
+        }
+
+    private:
+        ColorExpr colorExpr;
+    };
+
+    //shading pipeline of the ShaderDSL color expression
+    template<typename ColorExpr>
+    inline typename JDSLShadingPipeline<ColorExpr>::ptr makeShadingPipeline(const ShaderDSL::Expr<ColorExpr>& color) {
+        return std::make_shared<JDSLShadingPipeline<ColorExpr>>(color.self());
+    }
+}
+
+#endif //JSHADERDSL_H
@@ -6,6 +6,7 @@
 #define JSHADERPROGRAM_H
 
 #include "JShadingPipeline.h"
+#include <typeinfo>
 
 using std::shared_ptr;
 namespace JackalRenderer {
@@ -14,8 +15,17 @@ namespace JackalRenderer {
         using ptr = shared_ptr<J3DShadingPipeline>;
 
         virtual ~J3DShadingPipeline() = default;
+        //nullptr for subclasses, a copy as J3DShadingPipeline would drop their overrides, see JClonable
+        virtual JShadingPipeline::ptr clone() const override {
+            return typeid(*this) == typeid(J3DShadingPipeline) ? std::make_shared<J3DShadingPipeline>(*this) : nullptr;
+        }
         virtual void vertexShader(VertexData& vertex) const override;
+        //batched vertexShaderSIMD for J3DShadingPipeline itself, subclasses are shaded vertex by vertex unless they opt in
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override;
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+    protected:
+        //the transform of J3DShadingPipeline::vertexShader, 16 vertices at a time with SIMD. Only for subclasses that keep that vertexShader
+        void vertexShaderSIMD(const VertexStreamView& vertices, VertexData* out) const;
     };
 
     class JDoNothingShadingPipeline : public JShadingPipeline {
@@ -23,52 +33,89 @@ namespace JackalRenderer {
         using ptr = shared_ptr<JDoNothingShadingPipeline>;
 
         virtual ~JDoNothingShadingPipeline() = default;
+        virtual JShadingPipeline::ptr clone() const override {
+            return typeid(*this) == typeid(JDoNothingShadingPipeline) ? std::make_shared<JDoNothingShadingPipeline>(*this) : nullptr;
+        }
 
         virtual void vertexShader(VertexData &vertex) const override;
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
     };
 
-    class JTextureShadingPipeline final : public J3DShadingPipeline {
+    class JTextureShadingPipeline final : public JClonable<JTextureShadingPipeline, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JTextureShadingPipeline>;
 
         virtual ~JTextureShadingPipeline() = default;
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
     };
 
-    class JLODVisualizePipeline final : public J3DShadingPipeline {
+    class JLODVisualizePipeline final : public JClonable<JLODVisualizePipeline, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JLODVisualizePipeline>;
         virtual ~JLODVisualizePipeline() = default;
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
     };
 
-    class JPhongShadingPipeling final : public J3DShadingPipeline {
+    class JPhongShadingPipeling final : public JClonable<JPhongShadingPipeling, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JPhongShadingPipeling>;
         virtual ~JPhongShadingPipeling() = default;
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+        //fragmentShader for a whole quad, the fragments are shaded as SIMD lanes
+        virtual void fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const override;
+        /**
+         * @brief fragmentShaderQuad specialized on the JShaderFeature bits of the material, fragmentShaderQuad
+         * dispatches to the permutation of the current material
+         */
+        template<unsigned int Features>
+        void fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const;
     };
 
-    class JBlinnPhongShadingPipeline final : public J3DShadingPipeline {
+    class JBlinnPhongShadingPipeline final : public JClonable<JBlinnPhongShadingPipeline, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JBlinnPhongShadingPipeline>;
         virtual  ~JBlinnPhongShadingPipeline() = default;
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+        virtual void fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const override;
+        template<unsigned int Features>
+        void fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const;
+
+        virtual bool isDeferrable() const override { return true; }
+        virtual void fragmentSurfaceQuad(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const override;
+        virtual void lightingQuad(const glm::ivec2 &quadPos, const JGBufferTexel* const texels[4], const unsigned int &activeMask,
+            glm::vec4 fragColors[4]) const override;
+        //fragmentSurfaceQuad of a material, the overload for the G-buffer
+        template<unsigned int Features>
+        void fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const;
     };
 
-    class JBlinnPhongNormalMapShadingPipeline final : public J3DShadingPipeline {
+    class JBlinnPhongNormalMapShadingPipeline final : public JClonable<JBlinnPhongNormalMapShadingPipeline, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JBlinnPhongNormalMapShadingPipeline>;
         virtual ~JBlinnPhongNormalMapShadingPipeline() = default;
         virtual void vertexShader(VertexData &vertex) const override;
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+        virtual void fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const override;
+        template<unsigned int Features>
+        void fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const;
+
+        virtual bool isDeferrable() const override { return true; }
+        virtual void fragmentSurfaceQuad(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const override;
+        virtual void lightingQuad(const glm::ivec2 &quadPos, const JGBufferTexel* const texels[4], const unsigned int &activeMask,
+            glm::vec4 fragColors[4]) const override;
+        template<unsigned int Features>
+        void fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const;
     };
 
-    class JAlphaBlendingShadingPipeline final : public J3DShadingPipeline {
+    class JAlphaBlendingShadingPipeline final : public JClonable<JAlphaBlendingShadingPipeline, J3DShadingPipeline> {
     public:
         using ptr = shared_ptr<JAlphaBlendingShadingPipeline>;
         virtual ~JAlphaBlendingShadingPipeline() = default;
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const override { vertexShaderSIMD(vertices, out); }
         virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
     };
 }
@@ -11,8 +11,10 @@
 #include "glm/glm.hpp"
 #include <functional>
 #include "JLight.h"
+#include "JLightTable.h"
 #include "JTexture2D.h"
 #include "JPixelSampler.h"
+#include "JFrameBuffer.h"
 
 using std::vector;
 
@@ -20,13 +22,17 @@ namespace JackalRenderer {
     class JShadingPipeline {
     public:
         using ptr = std::shared_ptr<JShadingPipeline>;
+        //fractional bits of the fixed point grid the rasterizer works on, vertices may be snapped coarser
+        static constexpr int SUBPIXEL_BITS = 8;
         struct FragmentData;
+        class QuadFragments;
         struct VertexData {
             glm::vec3 pos;
             glm::vec3 nor;
             glm::vec2 tex;
             glm::vec4 cpos;
-            glm::ivec2 spos;
+            glm::ivec2 spos; //nearest pixel
+            glm::ivec2 fpos; //fixed point screen position, SUBPIXEL_BITS fractional bits
             glm::mat3 tbn;
             bool needInterpolatedTBN = false;
             float rhw; //Reciprocal Homogeneous W, 即w分量的倒数 1/w
@@ -40,6 +46,54 @@ namespace JackalRenderer {
 
             //perspective correction for interpolation
             static void prePerspCorrection(VertexData &v);
+
+            /**
+             * @brief sets spos and fpos from the viewport position, pixel centers are at integer coordinates
+             * @param subpixelBits precision the vertex is snapped to, 0 snaps to whole pixels, at most SUBPIXEL_BITS
+             */
+            static void snapScreenPos(VertexData &v, const glm::vec2 &screenPos, const int &subpixelBits);
+        };
+
+        //strided view of one vertex attribute, covers interleaved JVertex records as well as separate streams
+        template<typename T>
+        struct VertexStream {
+            const unsigned char* data = nullptr;
+            size_t stride = sizeof(T); //bytes between two vertices
+            VertexStream() = default;
+            VertexStream(const T* first, const size_t& strideInBytes = sizeof(T))
+                : data(reinterpret_cast<const unsigned char*>(first)), stride(strideInBytes) {}
+            const T& operator[](const size_t& i) const { return *reinterpret_cast<const T*>(data + i * stride); }
+        };
+
+        //non-owning span of count vertices, the input of vertexShaderBatch
+        struct VertexStreamView {
+            VertexStream<glm::vec3> positions;
+            VertexStream<glm::vec3> normals;
+            VertexStream<glm::vec2> texcoords;
+            VertexStream<glm::vec3> tangents;
+            VertexStream<glm::vec3> bitangents;
+            size_t count = 0;
+
+            //vertices [begin, end) of this span
+            VertexStreamView subview(const size_t& begin, const size_t& end) const {
+                VertexStreamView view = *this;
+                view.positions.data += begin * positions.stride;
+                view.normals.data += begin * normals.stride;
+                view.texcoords.data += begin * texcoords.stride;
+                view.tangents.data += begin * tangents.stride;
+                view.bitangents.data += begin * bitangents.stride;
+                view.count = end - begin;
+                return view;
+            }
+            //fetches vertex i into v, the attributes not stored in the streams are reset
+            void fetch(const size_t& i, VertexData& v) const {
+                v = VertexData();
+                v.pos = positions[i];
+                v.nor = normals[i];
+                v.tex = texcoords[i];
+                v.tbn[0] = tangents[i];
+                v.tbn[1] = bitangents[i];
+            }
         };
 
         struct FragmentData {
@@ -49,8 +103,6 @@ namespace JackalRenderer {
             glm::ivec2 spos;
             glm::mat3 tbn;
             float rhw;
-            JMaskPixelSampler coverage = 0;
-            JDepthPixelSampler coverageDepth = 0.0f;
 
             FragmentData() = default;
             FragmentData(const glm::ivec2 &screenPos) : spos(screenPos) {}
@@ -58,23 +110,103 @@ namespace JackalRenderer {
             static void aftPerspCorrection(FragmentData &v);
         };
 
+        //screen space plane equation of an attribute, value at the reference point plus per pixel steps
+        template<typename T>
+        struct AttributePlane {
+            T value;
+            T ddx;
+            T ddy;
+            inline T at(const float &dx, const float &dy) const { return value + ddx * dx + ddy * dy; }
+        };
+
+        /**
+         * @brief per triangle setup shared by all quads of a triangle: edge functions on the fixed point grid
+         * and plane equations of the perspective divided attributes, referenced to vertex 0
+         */
+        struct TriangleSetup {
+            long long I[3], J[3], K[3]; //edge functions 01, 12, 20, E(X, Y) = I * X + J * Y + K on the fixed point grid
+            long long delta; //twice the area, E01 + E12 + E20 everywhere
+            double one_div_delta;
+            int bias[3]; //top-left fill rule, 0 for top-left edges, 1 otherwise
+            float vertexRhw[3]; //rhw of the counter clockwise ordered vertices
+            glm::ivec2 boundingMin; //nearest pixels of the vertices, no sampling point beyond them is covered
+            glm::ivec2 boundingMax;
+            glm::vec2 origin; //screen position of vertex 0 in pixels
+            AttributePlane<glm::vec3> pos;
+            AttributePlane<glm::vec3> nor;
+            AttributePlane<glm::vec2> tex;
+            AttributePlane<float> rhw;
+            AttributePlane<glm::mat3> tbn;
+            bool needInterpolatedTBN = false;
+
+            /**
+             * @brief orders the vertices counter clockwise and builds the edge functions and attribute planes
+             * @param withAttributes false for depth only rasterization, which needs no attribute planes
+             * @return false for triangles without area
+             */
+            bool setup(const VertexData &v0, const VertexData &v1, const VertexData &v2, const bool &withAttributes = true);
+
+            /**
+             * @brief interpolates the perspective divided attributes of the quad at (x, y) by stepping the planes
+             * from its top-left pixel, and sets the uv derivatives of the quad
+             * @param pixelMask bit p set if fragment p of the quad is covered, the others become helper fragments
+             */
+            void interpolateQuad(const int &x, const int &y, const unsigned int &pixelMask, QuadFragments &quad) const;
+
+            //analytic uv derivatives of the perspective corrected uv at the screen position p
+            void uvDerivatives(const glm::vec2 &p, glm::vec2 &dUVdx, glm::vec2 &dUVdy) const;
+        };
+
+        /**
+         * @brief compact raster output of a 2x2 quad, attributes are interpolated from the triangle setup in the fragment stage
+         * @tparam SamplingNum sampling points per pixel (1, 2, 4 or 8) of the render target
+         */
+        template<int SamplingNum>
+        struct QuadRecord {
+            //sampling points of a 2x2 quad, lane = pixel * SamplingNum + sample
+            static constexpr int QUAD_SAMPLES = 4 * SamplingNum;
+            int triangle; //index of the triangle setup it belongs to
+            glm::ivec2 spos; //screen position of the top-left pixel
+            unsigned int coverage; //one bit per sampling point, bit = pixel * SamplingNum + sample
+            float depth[QUAD_SAMPLES]; //rhw of the sampling points, only valid for covered ones
+        };
+
         class QuadFragments {
         public:
-            FragmentData fragments[4];
-            inline float dUdx() const { return fragments[1].tex.x - fragments[0].tex.x; }
-            inline float dUdy() const { return fragments[2].tex.x - fragments[0].tex.x; }
-            inline float dVdx() const { return fragments[1].tex.y - fragments[0].tex.y; }
-            inline float dVdy() const { return fragments[2].tex.y - fragments[0].tex.y; }
+            FragmentData fragments[4]; //helper fragments (spos -1) are not interpolated
+            glm::ivec2 spos; //screen position of the top-left fragment
+            glm::vec2 dUVdx; //analytic uv derivatives at the quad center, from the triangle setup
+            glm::vec2 dUVdy;
 
             inline void aftPerspCorrectionforBlocks() {
-                JShadingPipeline::FragmentData::aftPerspCorrection(fragments[0]);
-                JShadingPipeline::FragmentData::aftPerspCorrection(fragments[1]);
-                JShadingPipeline::FragmentData::aftPerspCorrection(fragments[2]);
-                JShadingPipeline::FragmentData::aftPerspCorrection(fragments[3]);
+                for(auto &fragment : fragments) {
+                    if(fragment.spos.x != -1)
+                        JShadingPipeline::FragmentData::aftPerspCorrection(fragment);
+                }
             }
         };
 
+        //material features the shader permutations are specialized on, kept up to date by the material setters
+        enum JShaderFeature : unsigned int {
+            J_SHADER_DIFFUSE_TEX = 1u << 0,
+            J_SHADER_SPECULAR_TEX = 1u << 1,
+            J_SHADER_GLOW_TEX = 1u << 2,
+            J_SHADER_NORMAL_TEX = 1u << 3,
+            J_SHADER_LIGHTING = 1u << 4,
+            J_SHADER_TONE_MAPPING = 1u << 5 //HDR builds
+        };
+        static constexpr unsigned int SHADER_PERMUTATIONS = 1u << 6;
+
         virtual ~JShadingPipeline() = default;
+        /**
+         * @brief a copy of the pipeline with its current uniforms and material, the renderer records one per material
+         * so that the draws of a frame can be in flight together while the handler is set up for the next one.
+         * IMPORTANT: pipelines have to implement it to be rendered at full speed, derive them from JClonable.
+         * The default returns nullptr, as J3DShadingPipeline and JDoNothingShadingPipeline do for subclasses that
+         * do not override it. The renderer then records the pipeline itself and has to render the pass so far every
+         * time it changes the uniforms or the material, i.e. once per mesh and texture set, and warns once about it
+         */
+        virtual ptr clone() const { return nullptr; }
 
         void setModelMatrix(const glm::mat4& model) {
             //TODO
@@ -83,47 +215,136 @@ namespace JackalRenderer {
         }
 
         void setViewProjectMatrix(const glm::mat4& vp) { viewProjectMatrix = vp; }
-        void setLightingEnable(bool enable) { lightingEnable = enable; }
+        void setLightingEnable(bool enable) { lightingEnable = enable; setShaderFeature(J_SHADER_LIGHTING, enable); }
 
         void setAmbientCoef(const glm::vec3& ka) { kA = ka; }
         void setDiffuseCoef(const glm::vec3& kd) { kD = kd; }
         void setSpecularCoef(const glm::vec3& ks) { kS = ks; }
         void setEmissionColor(const glm::vec3& ke) { kE = ke; }
         void setTransparency(const float &alpha) { transparency = alpha; }
-        void setDiffuseTexId(const int& id) { diffuseTexId = id; }
-        void setSpecularTexId(const int& id) { specularTexId = id; }
-        void setNormalTexId(const int& id) { normalTexId = id; }
-        void setGlowTexId(const int& id) { glowTexId = id; }
+        void setDiffuseTexId(const int& id) { diffuseTexId = id; setShaderFeature(J_SHADER_DIFFUSE_TEX, id != -1); }
+        void setSpecularTexId(const int& id) { specularTexId = id; setShaderFeature(J_SHADER_SPECULAR_TEX, id != -1); }
+        void setNormalTexId(const int& id) { normalTexId = id; setShaderFeature(J_SHADER_NORMAL_TEX, id != -1); }
+        void setGlowTexId(const int& id) { glowTexId = id; setShaderFeature(J_SHADER_GLOW_TEX, id != -1); }
         void setShininess(const float& shininess) { this -> shininess = shininess; }
+        //JShaderFeature bits of the current material, selects the shader permutation
+        unsigned int getShaderFeatures() const { return shaderFeatures; }
 
 
         virtual void vertexShader(VertexData& vertex) const = 0;
+        /**
+         * @brief shades the vertices of the span into out[0, vertices.count). The default fetches and shades
+         * one vertex after another, pipelines may transform several vertices at once with SIMD instead
+         */
+        virtual void vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const;
         virtual void fragmentShader(const FragmentData& data, glm::vec4& fragColor, const glm::vec2& dUVdx, const glm::vec2& dUVdy) const = 0;
+        /**
+         * @brief shades fragment p of the quad into fragColors[p] for every bit p set in activeMask, helper fragments
+         * are left untouched. The default calls fragmentShader per fragment, pipelines may shade the four fragments
+         * as SIMD lanes and share per quad work such as the texture LODs instead
+         */
+        virtual void fragmentShaderQuad(const QuadFragments& quad, const unsigned int& activeMask, glm::vec4 fragColors[4]) const;
+        //pipelines whose fragment shader writes depth or discards fragments have to be depth tested after shading
+        virtual bool requiresLateDepthTest() const { return false; }
 
+        //deferred shading, pipelines that can split their lighting from the surface provide the three below
+        virtual bool isDeferrable() const { return false; }
+        //the surface attributes of fragment p for the G-buffer instead of its color, for every bit p set in activeMask
+        virtual void fragmentSurfaceQuad(const QuadFragments& quad, const unsigned int& activeMask, JGBufferTexel texels[4]) const {}
+        /**
+         * @brief the lighting pass, colors of the G-buffer texels of a 2x2 quad of pixels
+         * @param quadPos screen position of the top-left pixel
+         * @param texels the texels of the pixels set in activeMask, the others are null
+         */
+        virtual void lightingQuad(const glm::ivec2& quadPos, const JGBufferTexel* const texels[4], const unsigned int& activeMask,
+            glm::vec4 fragColors[4]) const {}
+
+        /**
+         * @brief rasterizes the part of the triangle inside [clipMin, clipMax] (inclusive pixel rect),
+         * 2x2 quads are always aligned to even screen coordinates so that a triangle split over several
+         * tiles produces exactly the same quads (and derivatives) as an unsplit one
+         * @param triangleId stored in the emitted records to find the triangle setup again
+         * @param hiZ if not null, blocks whose hierarchical z proves the triangle hidden emit no quads
+         * @param depthEqual the quads are depth tested for equality, see JFrameBuffer::isHiZOccluded
+         * @tparam SamplingNum sampling points per pixel, instantiated for 1, 2, 4 and 8
+         */
+        template<int SamplingNum>
         static void rasterizeFillEdgeFunction(
-            const VertexData& v0,
-            const VertexData& v1,
-            const VertexData& v2,
-            const uint& screenWidth,
-            const uint& screenHeight,
-            vector<QuadFragments>& rasterized_points);
+            const TriangleSetup& triangle,
+            const int& triangleId,
+            const glm::ivec2& clipMin,
+            const glm::ivec2& clipMax,
+            vector<QuadRecord<SamplingNum>>& rasterized_points,
+            JFrameBuffer* hiZ = nullptr,
+            const bool& depthEqual = false);
 
         static int uploadTexture2D(JTexture2D::ptr tex);
         static JTexture2D::ptr getTexture2D(int index);
         static int addLight(JLight::ptr lightSource);
         static JLight::ptr getLight(int index);
+        /**
+         * @brief compiles the lights into the light table and assigns them to the light clusters of the view frustum,
+         * once per frame before drawing
+         * @param near, far distances of the clipping planes
+         */
+        static void compileLights(const glm::mat4& view, const glm::mat4& project, const int& width, const int& height,
+            const float& near, const float& far);
+        /**
+         * @brief JLightTable::forEachQuadLight for the lights of the clusters the fragments of quad fall into,
+         * all lights as long as no clusters are built
+         */
+        template<typename F>
+        static void forEachQuadLight(const QuadFragments& quad, const glm::vec3 fragPos[4], const QuadVec3& pos, F shade) {
+            unsigned int laneMask = 0;
+            for(int k = 0; k < 4; ++k) {
+                if(quad.fragments[k].spos.x != -1)
+                    laneMask |= 1u << k;
+            }
+            forEachQuadLight(quad.spos, laneMask, fragPos, pos, shade);
+        }
+        //the same for the quad at quadPos whose fragPos are valid for the lanes in laneMask
+        template<typename F>
+        static void forEachQuadLight(const glm::ivec2& quadPos, const unsigned int& laneMask, const glm::vec3 fragPos[4],
+            const QuadVec3& pos, F shade) {
+            if(lightClusters.empty()) {
+                lightTable.forEachQuadLight(fragPos, pos, shade);
+                return;
+            }
+            JLightTable::QuadLights lists;
+            lightClusters.quadLights(quadPos, fragPos, laneMask, lists);
+            lightTable.forEachQuadLight(fragPos, pos, lists, shade);
+        }
+        /**
+         * @brief precomputes the per light products of the material, intensity * kA and intensity * kD.
+         * Called once per draw after the material and the light table are set
+         */
+        void prepareLights();
         static void setExposure(const float& _exposure) { exposure = _exposure; }
         static void setViewerPos(const glm::vec3& viewer) { viewerPos = viewer; }
 
         static glm::vec4 texture2D(const uint& id, const glm::vec2& uv, const glm::vec2& dUVdx, const glm::vec2& dUVdy);
+        //mipmap level texture2D samples with for the uv derivatives, the same for all fragments of a quad
+        static float textureLod(const uint& id, const glm::vec2& dUVdx, const glm::vec2& dUVdy);
+        static glm::vec4 texture2DLod(const uint& id, const glm::vec2& uv, const float& lod);
 
     protected:
+        struct LightProducts {
+            vector<glm::vec3> ambient; //intensity * kA of the lights in lightTable order
+            vector<glm::vec3> diffuse; //intensity * kD
+        };
+
+        void setShaderFeature(const unsigned int& feature, const bool& enable) {
+            shaderFeatures = enable ? (shaderFeatures | feature) : (shaderFeatures & ~feature);
+        }
+
         glm::mat4 modelMatrix = glm::mat4(1.0f);
         glm::mat3 inveTransModelMatrix = glm::mat3(1.0f);
         glm::mat4 viewProjectMatrix = glm::mat4(1.0f);
 
         static vector<JTexture2D::ptr> globalTextureUnits;
         static vector<JLight::ptr> lights;
+        static JLightTable lightTable;
+        static JLightClusters lightClusters;
         static glm::vec3 viewerPos;
         static float exposure;
 
@@ -138,6 +359,24 @@ namespace JackalRenderer {
         int normalTexId = -1;
         int glowTexId = -1;
         bool lightingEnable = true;
+        //written by prepareLights into a new object each time, so that clones share the products instead of copying them
+        std::shared_ptr<const LightProducts> lightProducts = std::make_shared<LightProducts>();
+#ifdef HDR
+        unsigned int shaderFeatures = J_SHADER_LIGHTING | J_SHADER_TONE_MAPPING;
+#else
+        unsigned int shaderFeatures = J_SHADER_LIGHTING;
+#endif
+    };
+
+    /**
+     * @brief clone() of Derived, pipelines derive from JClonable<Derived, Base> instead of Base,
+     * e.g. class MyPipeline final : public JClonable<MyPipeline, J3DShadingPipeline>
+     */
+    template<typename Derived, typename Base>
+    class JClonable : public Base {
+    public:
+        using Base::Base;
+        virtual JShadingPipeline::ptr clone() const override { return std::make_shared<Derived>(static_cast<const Derived&>(*this)); }
     };
 }
 
@@ -13,13 +13,24 @@ namespace JackalRenderer {
     enum JCullFaceMode { J_CULL_DISABLE, J_CULL_FRONT, J_CULL_BACK };
     enum JDepthTestMode { J_DEPTH_TEST_DISABLE, J_DEPTH_TEST_ENABLE };
     enum JDepthWriteMode { J_DEPTH_WRITE_DISABLE, J_DEPTH_WRITE_ENABLE };
+    //a sample passes if it is nearer than the stored depth, or exactly at it (after a depth prepass)
+    enum JDepthCompareMode { J_DEPTH_COMPARE_NEARER, J_DEPTH_COMPARE_EQUAL };
     enum JLightingMode { J_LIGHTING_DISABLE, J_LIGHTING_ENABLE };
-    enum JAlphaBlendingMode { J_ALPHA_DISABLE, J_ALPHA_BLENDING, J_ALPHA_TO_COVERAGE };
+    //order independent: weighted blended accumulation, the transparent draws need neither sorting nor ordered rendering
+    enum JAlphaBlendingMode { J_ALPHA_DISABLE, J_ALPHA_BLENDING, J_ALPHA_TO_COVERAGE, J_ALPHA_ORDER_INDEPENDENT };
+    //how rasterization and fragment work is distributed over worker threads,
+    //sort-last renders into a private framebuffer per worker and merges them by depth
+    enum JRasterParallelMode { J_RASTER_TILE_BINNING, J_RASTER_PIXEL_LOCK, J_RASTER_SORT_LAST };
+    //forward shades every fragment that passes the depth test, deferred writes a G-buffer and lights each visible pixel once
+    enum JShadingMode { J_SHADING_FORWARD, J_SHADING_DEFERRED };
+    //memory layout of the vertex attributes of a mesh, interleaved JVertex records or one stream per attribute
+    enum JVertexLayout { J_VERTEX_AOS, J_VERTEX_SOA };
     class JShadingState {
     public:
         JCullFaceMode cullFaceMode = JCullFaceMode::J_CULL_BACK;
         JDepthTestMode depthTestMode = JDepthTestMode::J_DEPTH_TEST_ENABLE;
         JDepthWriteMode depthWriteMode = JDepthWriteMode::J_DEPTH_WRITE_ENABLE;
+        JDepthCompareMode depthCompareMode = JDepthCompareMode::J_DEPTH_COMPARE_NEARER;
         JAlphaBlendingMode alphaBlendingMode = JAlphaBlendingMode::J_ALPHA_DISABLE;
     };
 }
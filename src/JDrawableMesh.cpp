@@ -14,17 +14,60 @@ using std::map;
 
 namespace JackalRenderer {
     JDrawableSubMesh::JDrawableSubMesh(const JDrawableSubMesh &mesh)
-        : vertices(mesh.vertices), indices(mesh.indices),drawingMaterial(mesh.drawingMaterial) {}
+        : vertices(mesh.vertices), indices(mesh.indices), layout(mesh.layout), streams(mesh.streams), drawingMaterial(mesh.drawingMaterial) {}
 
     JDrawableSubMesh& JDrawableSubMesh::operator=(const JDrawableSubMesh& mesh) {
         if(&mesh == this)
             return *this;
         this -> vertices = mesh.vertices;
         this -> indices = mesh.indices;
+        this -> layout = mesh.layout;
+        this -> streams = mesh.streams;
         this -> drawingMaterial = mesh.drawingMaterial;
         return *this;
     }
 
+    void JDrawableSubMesh::setVertices(const vector<JVertex> &vertices) {
+        this -> vertices = vertices;
+        if(layout == J_VERTEX_SOA) {
+            layout = J_VERTEX_AOS;
+            setVertexLayout(J_VERTEX_SOA);
+        }
+    }
+
+    void JDrawableSubMesh::setVertexLayout(JVertexLayout newLayout) {
+        if(newLayout == layout)
+            return;
+        if(newLayout == J_VERTEX_SOA) {
+            const size_t num = vertices.size();
+            streams.positions.resize(num);
+            streams.normals.resize(num);
+            streams.texcoords.resize(num);
+            streams.tangents.resize(num);
+            streams.bitangents.resize(num);
+            for(size_t i = 0; i < num; ++i) {
+                streams.positions[i] = vertices[i].vpostions;
+                streams.normals[i] = vertices[i].vnormals;
+                streams.texcoords[i] = vertices[i].vtexcoords;
+                streams.tangents[i] = vertices[i].vtangent;
+                streams.bitangents[i] = vertices[i].vbitanget;
+            }
+            vector<JVertex>().swap(vertices);
+        }else {
+            const size_t num = streams.size();
+            vertices.resize(num);
+            for(size_t i = 0; i < num; ++i) {
+                vertices[i].vpostions = streams.positions[i];
+                vertices[i].vnormals = streams.normals[i];
+                vertices[i].vtexcoords = streams.texcoords[i];
+                vertices[i].vtangent = streams.tangents[i];
+                vertices[i].vbitanget = streams.bitangents[i];
+            }
+            streams = JVertexStreams();
+        }
+        layout = newLayout;
+    }
+
     void JDrawableSubMesh::clear() {
         /*
          * 1. 创建一个新的空的vector<T>
@@ -34,6 +77,7 @@ namespace JackalRenderer {
          */
         vector<JVertex>().swap(this -> vertices);
         vector<uint>().swap(this -> indices);
+        this -> streams = JVertexStreams();
     }
 
     // ref: https://learnopengl.com/Model-Loading/Assimp
@@ -128,6 +172,11 @@ namespace JackalRenderer {
         wrapper.processNode(scene -> mRootNode, scene, drawables);
     }
 
+    void JDrawableMesh::setVertexLayout(JVertexLayout layout) {
+        for(auto &drawable : drawables)
+            drawable.setVertexLayout(layout);
+    }
+
     void JDrawableMesh::clear() {
         for(auto &drawable : drawables)
             drawable.clear();
@@ -3,31 +3,71 @@
 //
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
+#include <stdexcept>
 
 #include "JFrameBuffer.h"
 #include "JParallelWrapper.h"
+#include "JSIMDUtils.h"
 
 namespace JackalRenderer {
     using uchar = unsigned char;
 
-    JFrameBuffer::JFrameBuffer(int width, int height) : width(width), height(height) {
-        depthBuffer.resize(width * height, 1.0f); // rendering area
-        colorBuffer.resize(width * height, jBlack);
+    namespace {
+        /**
+         * @brief stores the 32 bit values of src into dst for every sampling point set in mask,
+         * groups of 4 sampling points are merged with one SSE2 blend instead of a branch per sample
+         */
+        template<int N>
+        inline void maskedStore32(void* dst, const void* src, const JTMaskPixelSampler<N>& mask) {
+            constexpr int samplingNum = N;
+            if(mask.full()) {
+                std::memcpy(dst, src, samplingNum * 4);
+                return;
+            }
+            int i = 0;
+#if defined(JACKAL_SIMD_SSE2)
+            for(; i + 4 <= samplingNum; i += 4) {
+                const unsigned int m = mask.bits >> i;
+                const __m128i select = _mm_set_epi32(-(int)((m >> 3) & 1u), -(int)((m >> 2) & 1u), -(int)((m >> 1) & 1u), -(int)(m & 1u));
+                __m128i* d = reinterpret_cast<__m128i*>(static_cast<char*>(dst) + i * 4);
+                const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(static_cast<const char*>(src) + i * 4));
+                _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(select, value), _mm_andnot_si128(select, _mm_loadu_si128(d))));
+            }
+#endif
+            for(; i < samplingNum; ++i) {
+                if(mask[i])
+                    std::memcpy(static_cast<char*>(dst) + i * 4, static_cast<const char*>(src) + i * 4, 4);
+            }
+        }
+    }
+
+    JFrameBuffer::JFrameBuffer(int width, int height, int samplingNum) : width(width), height(height), samplingNum(samplingNum) {
+        if(samplingNum != 1 && samplingNum != 2 && samplingNum != 4 && samplingNum != 8)
+            throw std::invalid_argument("JFrameBuffer: sampling number has to be 1, 2, 4 or 8");
+        depthBuffer.resize(width * height * samplingNum, 1.0f); // rendering area
+        colorBuffer.resize(width * height * samplingNum, jBlack);
+        hiZWidth = (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+        hiZHeight = (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+        hiZBuffer.resize(hiZWidth * hiZHeight, glm::vec2(1.0f));
+        hiZStale.resize(hiZWidth * hiZHeight, 0);
     }
 
     float JFrameBuffer::readDepth(const uint &x, const uint &y, const uint &i) const {
         if(x >= width || y >= height) return 0.0f;
-        return depthBuffer[y * width + x][i]; // i is the index of sampling point (MSAA4x, MSAA8x)
+        return depthBuffer[(y * width + x) * samplingNum + i]; // i is the index of sampling point (MSAA4x, MSAA8x)
     }
 
     JPixelRGBA JFrameBuffer::readColor(const uint &x, const uint &y, const uint &i) const {
         if(x >= width || y >= height) return jWhite; // { 255, 255, 255, 255}
-        return colorBuffer[y * width +x][i];
+        return colorBuffer[(y * width + x) * samplingNum + i];
     }
 
     void JFrameBuffer::clearDepth(const float &depth) { //reset
-        parallelLoop((size_t)0, (size_t)width * height, [&](const size_t &ind){ depthBuffer[ind] = depth; });
+        parallelLoop((size_t)0, depthBuffer.size(), [&](const size_t &ind){ depthBuffer[ind] = depth; });
+        std::fill(hiZBuffer.begin(), hiZBuffer.end(), glm::vec2(depth));
+        std::fill(hiZStale.begin(), hiZStale.end(), 0);
     }
 
     void JFrameBuffer::clearColor(const glm::vec4 &color) { // value range (0, 1) step 1/255
@@ -36,7 +76,7 @@ namespace JackalRenderer {
         uchar blue = static_cast<uchar>(255 * color.z);
         uchar alpha = static_cast<uchar>(255 * color.w);
         JPixelRGBA rgba = { red, green, blue, alpha };
-        parallelLoop((size_t)0, (size_t)width * height, [&](const size_t &ind){ colorBuffer[ind] = rgba; });
+        parallelLoop((size_t)0, colorBuffer.size(), [&](const size_t &ind){ colorBuffer[ind] = rgba; });
     }
 
     void JFrameBuffer::clearColorAndDepth(const glm::vec4 &color, const float &depth) {
@@ -45,10 +85,12 @@ namespace JackalRenderer {
         uchar blue = static_cast<uchar>(255 * color.z);
         uchar alpha = static_cast<uchar>(255 * color.w);
         JPixelRGBA rgba = { red, green, blue, alpha };
-        parallelLoop((size_t)0, (size_t)width * height, [&](const size_t &ind) {
+        parallelLoop((size_t)0, colorBuffer.size(), [&](const size_t &ind) {
             colorBuffer[ind] = rgba; // for each sampling point(1 - 4 - 8), fill rgba
             depthBuffer[ind] = depth; // for each sampling point(1 - 4 - 8), fill depth
         });
+        std::fill(hiZBuffer.begin(), hiZBuffer.end(), glm::vec2(depth));
+        std::fill(hiZStale.begin(), hiZStale.end(), 0);
     }
 
     void JFrameBuffer::writeColor(const uint &x, const uint &y, const uint &i, const glm::vec4 &color) {
@@ -58,10 +100,11 @@ namespace JackalRenderer {
         uchar blue = static_cast<uchar>(255 * color.z);
         uchar alpha = static_cast<uchar>(glm::min(255 * color.w, 255.0f)); // transparent: 0 opaque: 255
         JPixelRGBA rgba = { red, green, blue, alpha };
-        colorBuffer[y * width + x][i] = rgba;
+        colorBuffer[(y * width + x) * samplingNum + i] = rgba;
     }
 
-    void JFrameBuffer::writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JMaskPixelSampler &mask) {
+    template<int N>
+    void JFrameBuffer::writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JTMaskPixelSampler<N> &mask) {
         if(x>= width || y>= height) return;
         uchar red = static_cast<uchar>(255 * color.x);
         uchar green = static_cast<uchar>(255 * color.y);
@@ -69,16 +112,13 @@ namespace JackalRenderer {
         uchar alpha = static_cast<uchar>(255 * color.w);
         JPixelRGBA rgba = { red, green, blue, alpha };
 
-        int ind = y * width + x;
-#pragma unroll // unfold the loop to accelerate, try to avoid computation in this part
-        for(int i = 0; i < mask.getSamplingNum(); ++i) {
-            //only write color if the corresponding mask equals to 1
-            if(mask[i] == 1)
-                colorBuffer[ind][i] =rgba; //write single sampling point
-        }
+        //only write color to the sampling points set in the mask
+        const JTColorPixelSampler<N> src(rgba);
+        maskedStore32<N>(&colorBuffer[(y * width + x) * N], src.samplers.data(), mask);
     }
 
-    void JFrameBuffer::writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const JMaskPixelSampler &mask) {
+    template<int N>
+    void JFrameBuffer::writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const JTMaskPixelSampler<N> &mask) {
         if(x>= width || y>= height) return;
         uchar red = static_cast<uchar>(255 * color.x);
         uchar green = static_cast<uchar>(255 * color.y);
@@ -88,47 +128,210 @@ namespace JackalRenderer {
 
         const float srcAlpha = color.a;
         const float desAlpha = 1.0f - srcAlpha;
-        int ind = y * width + x;
+        JPixelRGBA* dst = &colorBuffer[(y * width + x) * N];
         // Refs: https://learnopengl-cn.github.io/04%20Advanced%20OpenGL/03%20Blending/
         // full blending
 #pragma unroll
-        for(int i = 0; i < mask.getSamplingNum(); ++i) {
-            if(mask[i] == 1) {
-                colorBuffer[ind][i][0] = srcAlpha * rgba[0] + desAlpha * colorBuffer[ind][i][0];
-                colorBuffer[ind][i][1] = srcAlpha * rgba[1] + desAlpha * colorBuffer[ind][i][1];
-                colorBuffer[ind][i][2] = srcAlpha * rgba[2] + desAlpha * colorBuffer[ind][i][2];
-                colorBuffer[ind][i][3] = srcAlpha * rgba[3] + desAlpha * colorBuffer[ind][i][3];
+        for(int i = 0; i < N; ++i) {
+            if(mask[i]) {
+                dst[i][0] = srcAlpha * rgba[0] + desAlpha * dst[i][0];
+                dst[i][1] = srcAlpha * rgba[1] + desAlpha * dst[i][1];
+                dst[i][2] = srcAlpha * rgba[2] + desAlpha * dst[i][2];
+                dst[i][3] = srcAlpha * rgba[3] + desAlpha * dst[i][3];
             }
         }
     }
 
     void JFrameBuffer::writeDepth(const uint &x, const uint &y, const uint &i, const float &value) {
         if(x>= width || y>= height) return;
-        depthBuffer[y * width + x][i] = value;
+        depthBuffer[(y * width + x) * samplingNum + i] = value;
+    }
+
+    template<int N>
+    void JFrameBuffer::writeDepthWithMask(const uint &x, const uint &y, const JTDepthPixelSampler<N> &depth, const JTMaskPixelSampler<N> &mask) {
+        if(x>= width || y>= height) return;
+        maskedStore32<N>(&depthBuffer[(y * width + x) * N], depth.samplers.data(), mask);
+    }
+
+    void JFrameBuffer::clearGBuffer() {
+        if(gBuffer.empty()) {
+            gBuffer.resize(width * height * samplingNum);
+            gBufferSurface.resize(width * height * samplingNum, 0);
+            return;
+        }
+        std::fill(gBufferSurface.begin(), gBufferSurface.end(), 0);
     }
 
-    void JFrameBuffer::writeDepthWithMask(const uint &x, const uint &y, const JDepthPixelSampler &depth, const JMaskPixelSampler &mask) {
+    template<int N>
+    void JFrameBuffer::writeGBufferWithMask(const uint &x, const uint &y, const JGBufferTexel &texel, const JTMaskPixelSampler<N> &mask) {
         if(x>= width || y>= height) return;
-        int ind = y * width + x;
+        const size_t base = (y * width + x) * N;
+        //the new surface takes the smallest id none of the remaining sampling points has, at most N
+        unsigned int used = 1u;
+        for(int i = 0; i < N; ++i) {
+            if(!mask[i])
+                used |= 1u << gBufferSurface[base + i];
+        }
+        unsigned char surface = 1;
+        while(used & (1u << surface))
+            ++surface;
+        for(int i = 0; i < N; ++i) {
+            if(!mask[i])
+                continue;
+            gBuffer[base + i] = texel;
+            gBufferSurface[base + i] = surface;
+        }
+    }
+
+    void JFrameBuffer::clearOIT() {
+        if(oitAccum.empty()) {
+            oitAccum.resize(width * height * samplingNum, glm::vec4(0.0f));
+            oitRevealage.resize(width * height * samplingNum, 1.0f);
+            return;
+        }
+        std::fill(oitAccum.begin(), oitAccum.end(), glm::vec4(0.0f));
+        std::fill(oitRevealage.begin(), oitRevealage.end(), 1.0f);
+    }
+
+    template<int N>
+    void JFrameBuffer::writeOITWithMask(const uint &x, const uint &y, const glm::vec4 &color, const JTDepthPixelSampler<N> &depth, const JTMaskPixelSampler<N> &mask) {
+        //nothing to accumulate into before clearOIT
+        if(x>= width || y>= height || oitAccum.empty()) return;
+        const float alpha = glm::clamp(color.a, 0.0f, 1.0f);
+        if(alpha <= 0.0f)
+            return;
+        const size_t base = (y * width + x) * N;
 #pragma unroll
-        for(int i = 0; i < mask.getSamplingNum(); ++i) {
-            if(mask[i] == 1)
-                depthBuffer[ind][i] = depth[i];
+        for(int i = 0; i < N; ++i) {
+            if(!mask[i])
+                continue;
+            //Refs: McGuire and Bavoil, Weighted Blended Order-Independent Transparency, equation 10, z is the view depth 1 / rhw
+            const float z = depth[i] > 0.0f ? 1.0f / depth[i] : 0.0f;
+            const float weight = alpha * glm::clamp(10.0f / (1e-5f + std::pow(z / 5.0f, 2.0f) + std::pow(z / 200.0f, 6.0f)), 1e-2f, 3e3f);
+            oitAccum[base + i] += glm::vec4(glm::vec3(color) * alpha, alpha) * weight;
+            oitRevealage[base + i] *= 1.0f - alpha;
         }
     }
 
-    const JColorBuffer &JFrameBuffer::resolve() {
+    void JFrameBuffer::resolveOIT() {
+        if(oitAccum.empty())
+            return;
+        parallelLoop((size_t)0, (size_t)width * height * samplingNum, [&](const size_t &index) {
+            const float revealage = oitRevealage[index];
+            if(revealage >= 1.0f)
+                return;
+            const glm::vec4 &accum = oitAccum[index];
+            //the weighted average color of the transparent surfaces covers 1 - revealage of the pixel
+            const glm::vec3 average = glm::vec3(accum) / glm::max(accum.a, 1e-5f);
+            const float coverage = 1.0f - revealage;
+            JPixelRGBA &dst = colorBuffer[index];
+            for(int c = 0; c < 3; ++c)
+                dst[c] = static_cast<uchar>(glm::min(255.0f * average[c], 255.0f) * coverage + dst[c] * revealage);
+            dst[3] = static_cast<uchar>(255.0f * coverage + dst[3] * revealage);
+        }, JExecutionPolicy::J_PARALLEL);
+    }
+
+    void JFrameBuffer::compositeNearest(const std::vector<const JFrameBuffer*> &sources, const bool &withColor) {
+        if(sources.empty())
+            return;
+        //pixel by pixel, the sources are walked inside so that every sampling point is written once
         parallelLoop((size_t)0, (size_t)width * height, [&](const size_t &index) {
-            auto &currentSample = colorBuffer[index];
+            const size_t begin = index * samplingNum;
+            for(size_t i = begin; i < begin + samplingNum; ++i) {
+                const JFrameBuffer* nearest = nullptr;
+                float depth = depthBuffer[i];
+                for(const JFrameBuffer* src : sources) {
+                    if(src -> depthBuffer[i] > depth) {
+                        depth = src -> depthBuffer[i];
+                        nearest = src;
+                    }
+                }
+                if(nearest == nullptr)
+                    continue;
+                depthBuffer[i] = depth;
+                if(withColor)
+                    colorBuffer[i] = nearest -> colorBuffer[i];
+            }
+        }, JExecutionPolicy::J_PARALLEL);
+        invalidateHiZ();
+    }
+
+    void JFrameBuffer::copyDepth(const JFrameBuffer &src) {
+        std::memcpy(depthBuffer.data(), src.depthBuffer.data(), depthBuffer.size() * sizeof(float));
+        invalidateHiZ();
+    }
+
+#define JACKAL_INSTANTIATE_MASKED_WRITES(N) \
+    template void JFrameBuffer::writeColorWithMask<N>(const uint &, const uint &, const glm::vec4 &, const JTMaskPixelSampler<N> &); \
+    template void JFrameBuffer::writeColorWithMaskAlphaBlending<N>(const uint &, const uint &, const glm::vec4 &, const JTMaskPixelSampler<N> &); \
+    template void JFrameBuffer::writeDepthWithMask<N>(const uint &, const uint &, const JTDepthPixelSampler<N> &, const JTMaskPixelSampler<N> &); \
+    template void JFrameBuffer::writeGBufferWithMask<N>(const uint &, const uint &, const JGBufferTexel &, const JTMaskPixelSampler<N> &); \
+    template void JFrameBuffer::writeOITWithMask<N>(const uint &, const uint &, const glm::vec4 &, const JTDepthPixelSampler<N> &, const JTMaskPixelSampler<N> &);
+    JACKAL_INSTANTIATE_MASKED_WRITES(1)
+    JACKAL_INSTANTIATE_MASKED_WRITES(2)
+    JACKAL_INSTANTIATE_MASKED_WRITES(4)
+    JACKAL_INSTANTIATE_MASKED_WRITES(8)
+#undef JACKAL_INSTANTIATE_MASKED_WRITES
+
+    void JFrameBuffer::invalidateHiZ(const uint &x, const uint &y) {
+        if(x >= width || y >= height) return;
+        hiZStale[(y / HIZ_BLOCK_SIZE) * hiZWidth + x / HIZ_BLOCK_SIZE] = 1;
+    }
+
+    void JFrameBuffer::invalidateHiZ() {
+        std::fill(hiZStale.begin(), hiZStale.end(), 1);
+    }
+
+    const glm::vec2 &JFrameBuffer::readHiZ(const uint &bx, const uint &by) {
+        const uint ind = by * hiZWidth + bx;
+        if(hiZStale[ind]) {
+            //depth only grows with the depth test on, but depth writes without it may lower it again,
+            //so the block is simply rebuilt from its samples
+            const uint x0 = bx * HIZ_BLOCK_SIZE, x1 = std::min(x0 + HIZ_BLOCK_SIZE, width);
+            const uint y0 = by * HIZ_BLOCK_SIZE, y1 = std::min(y0 + HIZ_BLOCK_SIZE, height);
+            glm::vec2 minmax(depthBuffer[(y0 * width + x0) * samplingNum]);
+            for(uint y = y0; y < y1; ++y) {
+                //the sampling points of a row of pixels are contiguous
+                const float *depth = &depthBuffer[(y * width + x0) * samplingNum];
+                const float *end = depth + (x1 - x0) * samplingNum;
+                for(; depth != end; ++depth) {
+                    minmax.x = std::min(minmax.x, *depth);
+                    minmax.y = std::max(minmax.y, *depth);
+                }
+            }
+            hiZBuffer[ind] = minmax;
+            hiZStale[ind] = 0;
+        }
+        return hiZBuffer[ind];
+    }
+
+    bool JFrameBuffer::isHiZOccluded(const glm::ivec2 &pmin, const glm::ivec2 &pmax, const float &nearestDepth, const bool &depthEqual) {
+        const int bx0 = std::max(pmin.x, 0) / HIZ_BLOCK_SIZE, by0 = std::max(pmin.y, 0) / HIZ_BLOCK_SIZE;
+        const int bx1 = std::min(pmax.x, (int)width - 1) / HIZ_BLOCK_SIZE, by1 = std::min(pmax.y, (int)height - 1) / HIZ_BLOCK_SIZE;
+        for(int by = by0; by <= by1; ++by) {
+            for(int bx = bx0; bx <= bx1; ++bx) {
+                //depth test fails if stored >= incoming, for depth-equal if stored != incoming
+                const float farthest = readHiZ(bx, by).x;
+                if(farthest < nearestDepth || (depthEqual && farthest == nearestDepth))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    template<int N>
+    void JFrameBuffer::resolveSampled() {
+        parallelLoop((size_t)0, (size_t)width * height, [&](const size_t &index) {
+            JPixelRGBA *currentSample = &colorBuffer[index * N];
             glm::vec4 sum(0.0f);
             #pragma unroll
-            for (int i = 0; i < currentSample.getSamplingNum(); ++i){
+            for (int i = 0; i < N; ++i){
                     sum.x += currentSample[i][0];
                     sum.y += currentSample[i][1];
                     sum.z += currentSample[i][2];
                     sum.w += currentSample[i][3];
             }
-            sum /= currentSample.getSamplingNum();
+            sum /= N;
             JPixelRGBA rgba;
             rgba[0] = static_cast<unsigned char>(sum.x);
             rgba[1] = static_cast<unsigned char>(sum.y);
@@ -136,7 +339,16 @@ namespace JackalRenderer {
             rgba[3] = static_cast<unsigned char>(sum.w);
             currentSample[0] = rgba;
         }, JExecutionPolicy::J_PARALLEL);
+    }
+
+    const JColorBuffer &JFrameBuffer::resolve() {
+        switch(samplingNum) {
+            case 1: break; //already resolved
+            case 2: resolveSampled<2>(); break;
+            case 4: resolveSampled<4>(); break;
+            case 8: resolveSampled<8>(); break;
+            default: throw std::runtime_error("JFrameBuffer: unsupported sampling number");
+        }
         return colorBuffer;
     }
 }
-
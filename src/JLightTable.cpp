@@ -0,0 +1,221 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#include "JLightTable.h"
+
+#include <cmath>
+#include <limits>
+#include "glm/gtc/matrix_transform.hpp"
+#include "JParallelWrapper.h"
+
+namespace JackalRenderer {
+    void JLightTable::compile(const vector<JLight::ptr>& lights) {
+        direct = DirectLights();
+        point = PointLights();
+        spot = SpotLights();
+        others.clear();
+        intensity.clear();
+        vector<glm::vec3> pointIntensity, spotIntensity, otherIntensity;
+        for(const auto& light : lights) {
+            //JSpotLight is a JPointLight, so it is tested first
+            if(auto spotLight = std::dynamic_pointer_cast<JSpotLight>(light)) {
+                const glm::vec3 pos = spotLight -> getLightPos();
+                const glm::vec3 dir = spotLight -> getSpotDir();
+                spot.posX.push_back(pos.x); spot.posY.push_back(pos.y); spot.posZ.push_back(pos.z);
+                spot.attConstant.push_back(spotLight -> getAttenuation().x);
+                spot.attLinear.push_back(spotLight -> getAttenuation().y);
+                spot.attQuadratic.push_back(spotLight -> getAttenuation().z);
+                spot.radius.push_back(influenceRadius(light -> intensity(), spotLight -> getAttenuation()));
+                spot.dirX.push_back(dir.x); spot.dirY.push_back(dir.y); spot.dirZ.push_back(dir.z);
+                spot.outerCutoff.push_back(spotLight -> getOuterCutoff());
+                spot.cutoffRange.push_back(spotLight -> getInnerCutoff() - spotLight -> getOuterCutoff());
+                spotIntensity.push_back(light -> intensity());
+            }else if(auto pointLight = std::dynamic_pointer_cast<JPointLight>(light)) {
+                const glm::vec3 pos = pointLight -> getLightPos();
+                point.posX.push_back(pos.x); point.posY.push_back(pos.y); point.posZ.push_back(pos.z);
+                point.attConstant.push_back(pointLight -> getAttenuation().x);
+                point.attLinear.push_back(pointLight -> getAttenuation().y);
+                point.attQuadratic.push_back(pointLight -> getAttenuation().z);
+                point.radius.push_back(influenceRadius(light -> intensity(), pointLight -> getAttenuation()));
+                pointIntensity.push_back(light -> intensity());
+            }else if(auto directLight = std::dynamic_pointer_cast<JDirectLight>(light)) {
+                const glm::vec3& dir = directLight -> getLightDir();
+                direct.dirX.push_back(dir.x); direct.dirY.push_back(dir.y); direct.dirZ.push_back(dir.z);
+                intensity.push_back(light -> intensity());
+            }else if(light != nullptr) {
+                others.push_back(light);
+                otherIntensity.push_back(light -> intensity());
+            }
+        }
+        intensity.insert(intensity.end(), pointIntensity.begin(), pointIntensity.end());
+        intensity.insert(intensity.end(), spotIntensity.begin(), spotIntensity.end());
+        intensity.insert(intensity.end(), otherIntensity.begin(), otherIntensity.end());
+    }
+
+    float JLightTable::influenceRadius(const glm::vec3& intensity, const glm::vec3& attenuation) {
+        //intensity / (c + l * d + q * d * d) < threshold  <=>  q * d * d + l * d + c - maxIntensity / threshold > 0
+        const float maxIntensity = glm::max(intensity.x, glm::max(intensity.y, intensity.z));
+        const float k = maxIntensity / INFLUENCE_THRESHOLD - attenuation.x;
+        if(k <= 0.0f)
+            return 0.0f;
+        if(attenuation.z > 0.0f)
+            return (-attenuation.y + std::sqrt(attenuation.y * attenuation.y + 4.0f * attenuation.z * k)) / (2.0f * attenuation.z);
+        if(attenuation.y > 0.0f)
+            return k / attenuation.y;
+        return std::numeric_limits<float>::infinity();
+    }
+
+    namespace {
+        //view space bounding sphere of a cluster
+        struct ClusterBounds {
+            glm::vec3 center;
+            float radius;
+        };
+
+        bool sphereIntersects(const ClusterBounds& bounds, const glm::vec3& center, const float& radius) {
+            const glm::vec3 d = bounds.center - center;
+            const float r = bounds.radius + radius;
+            return glm::dot(d, d) <= r * r;
+        }
+
+        //Refs: Bart Wronski, Cull that cone! the sphere is outside of the cone if its closest point lies beyond the cone surface
+        bool coneIntersects(const ClusterBounds& bounds, const glm::vec3& apex, const glm::vec3& axis,
+            const float& cosAngle, const float& range) {
+            const glm::vec3 v = bounds.center - apex;
+            const float lenSq = glm::dot(v, v);
+            const float along = glm::dot(v, axis);
+            const float sinAngle = std::sqrt(glm::max(0.0f, 1.0f - cosAngle * cosAngle));
+            const float closest = cosAngle * std::sqrt(glm::max(0.0f, lenSq - along * along)) - along * sinAngle;
+            return !(closest > bounds.radius || along > bounds.radius + range || along < -bounds.radius);
+        }
+    }
+
+    void JLightClusters::build(const JLightTable& table, const glm::mat4& view, const glm::mat4& project,
+        const int& width, const int& height, const float& near, const float& far) {
+        if(!(near > 0.0f && far > near) || width <= 0 || height <= 0) {
+            //no usable frustum, shaders fall back to all lights
+            clusterLights.clear();
+            return;
+        }
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        nearDepth = near;
+        sliceScale = DEPTH_SLICES / std::log(far / near);
+        viewDepthRow = -glm::vec4(view[0][2], view[1][2], view[2][2], view[3][2]);
+        clusterLights.resize(static_cast<size_t>(tilesX * tilesY * DEPTH_SLICES));
+
+        //lights that reach every cluster
+        vector<unsigned int> global;
+        for(size_t i = 0; i < table.pointBegin(); ++i)
+            global.push_back(static_cast<unsigned int>(i));
+        vector<unsigned int> others;
+        for(size_t i = table.othersBegin(); i < table.size(); ++i)
+            others.push_back(static_cast<unsigned int>(i));
+
+        //the lights in view space
+        const size_t numPoints = table.point.posX.size();
+        const size_t numSpots = table.spot.posX.size();
+        vector<glm::vec3> pointPos(numPoints), spotPos(numSpots), spotAxis(numSpots);
+        for(size_t l = 0; l < numPoints; ++l)
+            pointPos[l] = glm::vec3(view * glm::vec4(table.point.posX[l], table.point.posY[l], table.point.posZ[l], 1.0f));
+        for(size_t l = 0; l < numSpots; ++l) {
+            spotPos[l] = glm::vec3(view * glm::vec4(table.spot.posX[l], table.spot.posY[l], table.spot.posZ[l], 1.0f));
+            //the spot direction points from the lit fragments towards the light
+            spotAxis[l] = glm::normalize(glm::mat3(view) * -glm::vec3(table.spot.dirX[l], table.spot.dirY[l], table.spot.dirZ[l]));
+        }
+
+        const glm::mat4 inverseProject = glm::inverse(project);
+        const float halfW = width * 0.5f;
+        const float halfH = height * 0.5f;
+        auto unproject = [&](const float& sx, const float& sy, const float& ndcZ) -> glm::vec3 {
+            //inverse of the viewport transform, sx = ndcX * halfW + halfW and sy = -ndcY * halfH + halfH
+            const glm::vec4 p = inverseProject * glm::vec4(sx / halfW - 1.0f, 1.0f - sy / halfH, ndcZ, 1.0f);
+            return glm::vec3(p) / p.w;
+        };
+        auto sliceDepth = [&](const int& slice) -> float {
+            return near * std::pow(far / near, static_cast<float>(slice) / DEPTH_SLICES);
+        };
+
+        parallelLoop(static_cast<size_t>(0), clusterLights.size(), [&](size_t c) {
+            const int slice = static_cast<int>(c % DEPTH_SLICES);
+            const int tile = static_cast<int>(c / DEPTH_SLICES);
+            const int tx = tile % tilesX;
+            const int ty = tile / tilesX;
+
+            //the tile grows by a pixel, fragment positions are not clamped to pixel centers
+            const float x0 = static_cast<float>(tx * TILE_SIZE - 1);
+            const float x1 = static_cast<float>((tx + 1) * TILE_SIZE + 1);
+            const float y0 = static_cast<float>(ty * TILE_SIZE - 1);
+            const float y1 = static_cast<float>((ty + 1) * TILE_SIZE + 1);
+            const float d0 = sliceDepth(slice);
+            const float d1 = sliceDepth(slice + 1);
+
+            //the corners of the sub-frustum lie on the lines from the near to the far plane through the tile corners
+            glm::vec3 corners[8];
+            const float sxs[2] = { x0, x1 };
+            const float sys[2] = { y0, y1 };
+            for(int k = 0; k < 4; ++k) {
+                const glm::vec3 onNear = unproject(sxs[k & 1], sys[k >> 1], -1.0f);
+                const glm::vec3 onFar = unproject(sxs[k & 1], sys[k >> 1], 1.0f);
+                const float range = onNear.z - onFar.z;
+                corners[k * 2] = onNear + (onFar - onNear) * ((d0 + onNear.z) / range);
+                corners[k * 2 + 1] = onNear + (onFar - onNear) * ((d1 + onNear.z) / range);
+            }
+            ClusterBounds bounds;
+            bounds.center = glm::vec3(0.0f);
+            for(const auto& corner : corners)
+                bounds.center += corner;
+            bounds.center *= 0.125f;
+            bounds.radius = 0.0f;
+            for(const auto& corner : corners)
+                bounds.radius = glm::max(bounds.radius, glm::length(corner - bounds.center));
+
+            //table order, so that the lists of a quad merge in one pass
+            vector<unsigned int>& list = clusterLights[c];
+            list = global;
+            for(size_t l = 0; l < numPoints; ++l) {
+                if(sphereIntersects(bounds, pointPos[l], table.point.radius[l]))
+                    list.push_back(static_cast<unsigned int>(table.pointBegin() + l));
+            }
+            for(size_t l = 0; l < numSpots; ++l) {
+                const float radius = table.spot.radius[l];
+                const bool reached = table.spot.outerCutoff[l] > 0.0f && radius < std::numeric_limits<float>::infinity()
+                    ? coneIntersects(bounds, spotPos[l], spotAxis[l], table.spot.outerCutoff[l], radius)
+                    : sphereIntersects(bounds, spotPos[l], radius);
+                if(reached)
+                    list.push_back(static_cast<unsigned int>(table.spotBegin() + l));
+            }
+            list.insert(list.end(), others.begin(), others.end());
+        });
+    }
+
+    int JLightClusters::depthSlice(const glm::vec3& worldPos) const {
+        const float depth = glm::dot(viewDepthRow, glm::vec4(worldPos, 1.0f));
+        if(!(depth > nearDepth))
+            return 0;
+        const int slice = static_cast<int>(std::log(depth / nearDepth) * sliceScale);
+        return slice < DEPTH_SLICES ? slice : DEPTH_SLICES - 1;
+    }
+
+    void JLightClusters::quadLights(const glm::ivec2& quadPos, const glm::vec3 fragPos[4], const unsigned int& laneMask,
+        JLightTable::QuadLights& lights) const {
+        const int tx = glm::clamp(quadPos.x / TILE_SIZE, 0, tilesX - 1);
+        const int ty = glm::clamp(quadPos.y / TILE_SIZE, 0, tilesY - 1);
+        const size_t tileBase = static_cast<size_t>(ty * tilesX + tx) * DEPTH_SLICES;
+        unsigned int slices = 0; //one bit per slice already added
+        lights.num = 0;
+        for(int k = 0; k < 4; ++k) {
+            if(!(laneMask & (1u << k)))
+                continue;
+            const int slice = depthSlice(fragPos[k]);
+            if(slices & (1u << slice))
+                continue;
+            slices |= 1u << slice;
+            const vector<unsigned int>& list = clusterLights[tileBase + slice];
+            lights.begin[lights.num] = list.data();
+            lights.end[lights.num] = list.data() + list.size();
+            ++lights.num;
+        }
+    }
+}
@@ -0,0 +1,114 @@
+﻿//
+// Created by jonas on 2026/10/18.
+//
+
+#include "JPipelineTuner.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include "JSIMDUtils.h"
+
+namespace JackalRenderer {
+    namespace {
+        //largest power of two not above value, within [MIN_BATCH_FACES, MAX_BATCH_FACES]
+        int batchFaces(const double& value) {
+            int faces = JPipelineTuner::MIN_BATCH_FACES;
+            while(faces < JPipelineTuner::MAX_BATCH_FACES && faces * 2 <= value)
+                faces *= 2;
+            return faces;
+        }
+    }
+
+    void JPipelineTuner::update(const JPipelineStats& stats, const int& concurrency) {
+        if(stats.faces == 0 || stats.seconds <= 0.0)
+            return;
+        const int workers = std::max(concurrency, 1);
+        const double seconds = stats.seconds * workers / stats.faces;
+        faceSeconds = faceSeconds == 0.0 ? seconds : 0.75 * faceSeconds + 0.25 * seconds;
+
+        //a chunk is TARGET_ITEM_SECONDS of work, but there are enough chunks for every worker
+        const double balancedFaces = static_cast<double>(stats.faces) / (workers * CHUNKS_PER_WORKER);
+        tuning.chunkFaces = batchFaces(std::min(TARGET_ITEM_SECONDS / faceSeconds, std::max(balancedFaces, (double)MIN_BATCH_FACES)));
+        //every worker has TARGET_ITEM_SECONDS of faces queued
+        tuning.inflightFaces = std::max(batchFaces(workers * TARGET_ITEM_SECONDS / faceSeconds), workers);
+        //the same heuristic as the binning chunks, the frame stats do not time sort-last apart. calibratePipeline tunes it on its own
+        tuning.sortLastFaces = tuning.chunkFaces;
+    }
+
+    JSceneClass JPipelineTuner::classify(const JPipelineStats& stats) {
+        const double quadsPerTriangle = stats.triangles == 0 ? 0.0 : static_cast<double>(stats.quads) / stats.triangles;
+        if(quadsPerTriangle < 2.0)
+            return J_SCENE_MICRO_TRIANGLES;
+        if(quadsPerTriangle < 32.0)
+            return J_SCENE_SMALL_TRIANGLES;
+        return J_SCENE_LARGE_TRIANGLES;
+    }
+
+    const char* JPipelineTuner::sceneClassName(const JSceneClass& sceneClass) {
+        switch(sceneClass) {
+            case J_SCENE_MICRO_TRIANGLES: return "micro";
+            case J_SCENE_SMALL_TRIANGLES: return "small";
+            default: return "large";
+        }
+    }
+
+    string JPipelineTuner::machineKey(const int& concurrency) {
+        std::stringstream key;
+        key << "threads" << concurrency;
+#if defined(JACKAL_SIMD_AVX2)
+        key << "-avx2";
+#elif defined(JACKAL_SIMD_SSE2)
+        key << "-sse2";
+#endif
+        return key.str();
+    }
+
+    bool JPipelineTuner::loadCalibration(const string& path, const string& machine, const JSceneClass& sceneClass, JPipelineTuning& tuning) {
+        std::ifstream file(path);
+        if(!file.is_open())
+            return false;
+        string line;
+        while(std::getline(file, line)) {
+            std::stringstream ss(line);
+            string lineMachine, lineClass;
+            JPipelineTuning lineTuning;
+            if(!(ss >> lineMachine >> lineClass >> lineTuning.chunkFaces >> lineTuning.inflightFaces))
+                continue;
+            if(lineMachine == machine && lineClass == sceneClassName(sceneClass)) {
+                tuning.chunkFaces = std::max(lineTuning.chunkFaces, 1);
+                tuning.inflightFaces = std::max(lineTuning.inflightFaces, 1);
+                if(ss >> lineTuning.sortLastFaces)
+                    tuning.sortLastFaces = std::max(lineTuning.sortLastFaces, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool JPipelineTuner::saveCalibration(const string& path, const string& machine, const JSceneClass& sceneClass, const JPipelineTuning& tuning) {
+        //the entries of other machines and scene classes are kept
+        std::vector<string> lines;
+        {
+            std::ifstream file(path);
+            string line;
+            while(std::getline(file, line)) {
+                std::stringstream ss(line);
+                string lineMachine, lineClass;
+                if(ss >> lineMachine >> lineClass && lineMachine == machine && lineClass == sceneClassName(sceneClass))
+                    continue;
+                if(!line.empty())
+                    lines.push_back(line);
+            }
+        }
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        if(!file.is_open())
+            return false;
+        for(const auto& line : lines)
+            file << line << "\n";
+        file << machine << " " << sceneClassName(sceneClass) << " " << tuning.chunkFaces << " " << tuning.inflightFaces
+            << " " << tuning.sortLastFaces << "\n";
+        return file.good();
+    }
+}
@@ -10,42 +10,68 @@
 #include "JShaderProgram.h"
 #include "JMathUtils.h"
 #include "JParallelWrapper.h"
+#include "JSIMDUtils.h"
 
 #include "tbb/parallel_pipeline.h"
 #include "tbb/task_arena.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/concurrent_queue.h"
 
 #include <mutex>
 #include <atomic>
 #include <thread>
+#include <stdexcept>
+#include <chrono>
+#include <limits>
+#include <type_traits>
+#include <iostream>
 #include <assimp/mesh.h>
 
 using std::atomic;
 
 namespace JackalRenderer {
     using MutexType = tbb::spin_mutex;//自旋锁, 忙等待
-    static constexpr int PIPELINE_BATCH_SIZE = 512; //
+    static constexpr int RASTER_TILE_SIZE = 64; //screen tile edge in pixels for sort-middle binning, must be even
     //CPP 11 standard之后，const和constexpr分工明确， const代表只读，而constexpr代表常量表达式，只读并不代表不会被修改
-    using FragmentCache = array<vector<JShadingPipeline::QuadFragments>, PIPELINE_BATCH_SIZE>;
+    //raster output of one face: its post-clip triangles and their compact quad records
+    template<int N>
+    struct FaceFragments {
+        int draw = -1; //of the frame stream
+        vector<JShadingPipeline::TriangleSetup> triangles;
+        vector<JShadingPipeline::QuadRecord<N>> quads;
+    };
+    template<int N>
+    using FragmentCache = vector<FaceFragments<N>>; //one slot per face in flight
+    //slots of the fragment cache not used by a face in flight
+    using FreeSlots = tbb::concurrent_queue<int>;
+    //triangles and quads counted by each worker
+    using StageCounters = tbb::enumerable_thread_specific<JPipelineStats>;
 
     class DrawcallSetting final {
     public:
         //类中const变量可以在构造函数中才初始化，这符合C++的规则
-        const JVertexBuffer& vertex_buffer;
+        const JShadingPipeline::VertexStreamView vertex_streams;
         const JIndexBuffer& index_buffer;
         JShadingPipeline* shader_handler;
-        const JShadingState& shading_state;
+        const JShadingState shading_state; //a copy, the renderer state moves on to the next draw before this one is shaded
         const glm::mat4& viewport_matrix;
         float near, far;
         JFrameBuffer* frame_buffer;
+        int subpixel_bits = JShadingPipeline::SUBPIXEL_BITS; //vertex snapping precision
+        bool geometry_pass = false; //fragments write their surface into the G-buffer instead of their color
+        bool depth_only = false; //depth prepass, quads are depth tested and written without being interpolated or shaded
+        //post-transform cache filled by transformVertices, shaded vertices and their outcodes by vertex index
+        const JShadingPipeline::VertexData* transformed_vertices = nullptr;
+        const unsigned int* vertex_outcodes = nullptr;
         explicit DrawcallSetting(
-            const JVertexBuffer& vbo,
+            const JShadingPipeline::VertexStreamView& vbo,
             const JIndexBuffer& ibo,
             JShadingPipeline* handler,
             const JShadingState& state,
             const glm::mat4& viewportMat,
             float np,
             float fp,
-            JFrameBuffer* fbo) : vertex_buffer(vbo), index_buffer(ibo),
+            JFrameBuffer* fbo) : vertex_streams(vbo), index_buffer(ibo),
         shader_handler(handler), shading_state(state),
         viewport_matrix(viewportMat),near(np), far(fp), frame_buffer(fbo) {}
     };
@@ -73,22 +99,257 @@ namespace JackalRenderer {
         }
     };
 
+    //clip space guard band as a multiple of the view volume, screen positions inside it stay far from
+    //overflowing the fixed point grid and the 64 bit edge functions
+    static constexpr float GUARD_BAND = 8.0f;
+    static constexpr int VERTEX_BATCH_SIZE = 256; //vertices shaded and classified together by transformVertices
+
+    //clip space outcode bits, set if a vertex is outside the plane
+    enum ClipOutcode : unsigned int {
+        CLIP_POS_X = 1u << 0, CLIP_NEG_X = 1u << 1, CLIP_POS_Y = 1u << 2, CLIP_NEG_Y = 1u << 3, //view volume
+        CLIP_POS_Z = 1u << 4, CLIP_NEG_Z = 1u << 5, //far and near plane
+        CLIP_FAR_W = 1u << 6, CLIP_NEAR_W = 1u << 7, //w out of [near, far]
+        GUARD_POS_X = 1u << 8, GUARD_NEG_X = 1u << 9, GUARD_POS_Y = 1u << 10, GUARD_NEG_Y = 1u << 11 //guard band
+    };
+    //a triangle is rejected if all its vertices are outside one of these planes
+    static constexpr unsigned int CLIP_REJECT_MASK = 0xFFu;
+    //and has to be clipped if any vertex is outside one of these
+    static constexpr unsigned int CLIP_REQUIRED_MASK = CLIP_POS_Z | CLIP_NEG_Z | GUARD_POS_X | GUARD_NEG_X | GUARD_POS_Y | GUARD_NEG_Y;
+
+    static inline unsigned int computeOutcode(const glm::vec4& p, const float& near, const float& far) {
+        const float guard = GUARD_BAND * p.w;
+        return (p.x > p.w ? CLIP_POS_X : 0u) | (p.x < -p.w ? CLIP_NEG_X : 0u)
+            | (p.y > p.w ? CLIP_POS_Y : 0u) | (p.y < -p.w ? CLIP_NEG_Y : 0u)
+            | (p.z > p.w ? CLIP_POS_Z : 0u) | (p.z < -p.w ? CLIP_NEG_Z : 0u)
+            | (p.w > far ? CLIP_FAR_W : 0u) | (p.w < near ? CLIP_NEAR_W : 0u)
+            | (p.x > guard ? GUARD_POS_X : 0u) | (p.x < -guard ? GUARD_NEG_X : 0u)
+            | (p.y > guard ? GUARD_POS_Y : 0u) | (p.y < -guard ? GUARD_NEG_Y : 0u);
+    }
+
+    /**
+     * @brief outcodes of num vertices, with SSE2 four vertices are classified against all planes at once
+     * (their clip positions transposed into x, y, z and w registers), the remainder is done one by one
+     */
+    static void computeOutcodes(const JShadingPipeline::VertexData* vertices, const int& num, const float& near, const float& far,
+        unsigned int* outcodes) {
+        int i = 0;
+#if defined(JACKAL_SIMD_SSE2)
+        const __m128 nearW = _mm_set1_ps(near), farW = _mm_set1_ps(far), guardBand = _mm_set1_ps(GUARD_BAND);
+        const __m128 signBit = _mm_set1_ps(-0.0f);
+        for(; i + 4 <= num; i += 4) {
+            __m128 x = _mm_loadu_ps(&vertices[i + 0].cpos.x);
+            __m128 y = _mm_loadu_ps(&vertices[i + 1].cpos.x);
+            __m128 z = _mm_loadu_ps(&vertices[i + 2].cpos.x);
+            __m128 w = _mm_loadu_ps(&vertices[i + 3].cpos.x);
+            _MM_TRANSPOSE4_PS(x, y, z, w);
+            const __m128 negW = _mm_xor_ps(w, signBit);
+            const __m128 guard = _mm_mul_ps(w, guardBand), negGuard = _mm_xor_ps(guard, signBit);
+            //one 4 bit lane mask per plane, in the order of the outcode bits
+            const int planes[12] = {
+                _mm_movemask_ps(_mm_cmpgt_ps(x, w)), _mm_movemask_ps(_mm_cmplt_ps(x, negW)),
+                _mm_movemask_ps(_mm_cmpgt_ps(y, w)), _mm_movemask_ps(_mm_cmplt_ps(y, negW)),
+                _mm_movemask_ps(_mm_cmpgt_ps(z, w)), _mm_movemask_ps(_mm_cmplt_ps(z, negW)),
+                _mm_movemask_ps(_mm_cmpgt_ps(w, farW)), _mm_movemask_ps(_mm_cmplt_ps(w, nearW)),
+                _mm_movemask_ps(_mm_cmpgt_ps(x, guard)), _mm_movemask_ps(_mm_cmplt_ps(x, negGuard)),
+                _mm_movemask_ps(_mm_cmpgt_ps(y, guard)), _mm_movemask_ps(_mm_cmplt_ps(y, negGuard))
+            };
+            for(int lane = 0; lane < 4; ++lane) {
+                unsigned int code = 0;
+                for(int b = 0; b < 12; ++b)
+                    code |= (unsigned int)((planes[b] >> lane) & 1) << b;
+                outcodes[i + lane] = code;
+            }
+        }
+#endif
+        for(; i < num; ++i)
+            outcodes[i] = computeOutcode(vertices[i].cpos, near, far);
+    }
+
+    //v0, v1, v2 are fixed point screen positions
+    static inline bool faceCulling(const glm::ivec2& v0, const glm::ivec2& v1, const glm::ivec2& v2, JCullFaceMode mode) {
+        if(mode == JCullFaceMode::J_CULL_DISABLE)
+            return false;
+        glm::i64vec2 e1 = glm::i64vec2(v1) - glm::i64vec2(v0);
+        glm::i64vec2 e2 = glm::i64vec2(v2) - glm::i64vec2(v0);
+        long long orient = e1.x * e2.y - e1.y * e2.x;
+        //orient > 0 背面， < 0 正面
+        return (mode == JCullFaceMode::J_CULL_BACK) ? orient > 0 : orient < 0;
+    }
+
+    //vertex streams of a submesh in either layout, interleaved records are read with the stride of JVertex
+    static JShadingPipeline::VertexStreamView makeVertexStreamView(const JDrawableSubMesh& submesh) {
+        JShadingPipeline::VertexStreamView view;
+        view.count = submesh.getVertexNum();
+        if(submesh.getVertexLayout() == J_VERTEX_SOA) {
+            const auto& streams = submesh.getVertexStreams();
+            view.positions = JShadingPipeline::VertexStream<glm::vec3>(streams.positions.data());
+            view.normals = JShadingPipeline::VertexStream<glm::vec3>(streams.normals.data());
+            view.texcoords = JShadingPipeline::VertexStream<glm::vec2>(streams.texcoords.data());
+            view.tangents = JShadingPipeline::VertexStream<glm::vec3>(streams.tangents.data());
+            view.bitangents = JShadingPipeline::VertexStream<glm::vec3>(streams.bitangents.data());
+        }else if(view.count > 0) {
+            const JVertex* vertices = submesh.getVertices().data();
+            view.positions = JShadingPipeline::VertexStream<glm::vec3>(&vertices -> vpostions, sizeof(JVertex));
+            view.normals = JShadingPipeline::VertexStream<glm::vec3>(&vertices -> vnormals, sizeof(JVertex));
+            view.texcoords = JShadingPipeline::VertexStream<glm::vec2>(&vertices -> vtexcoords, sizeof(JVertex));
+            view.tangents = JShadingPipeline::VertexStream<glm::vec3>(&vertices -> vtangent, sizeof(JVertex));
+            view.bitangents = JShadingPipeline::VertexStream<glm::vec3>(&vertices -> vbitanget, sizeof(JVertex));
+        }
+        return view;
+    }
+
+    /**
+     * @brief clipping, viewport mapping and face culling of the faces [startFace, endFace), their vertices are read
+     * from the post-transform cache of the drawcall. emit(v0, v1, v2) is called for every screen space triangle that
+     * survives, only triangles crossing the near/far planes or the guard band go through the clipper.
+     */
+    template<typename EmitFunction>
+    static void processFaces(const DrawcallSetting& draw_call, int startFace, int endFace, const EmitFunction& emit) {
+        const auto& indexBuffer = draw_call.index_buffer;
+        JShadingPipeline::VertexData v[3];
+        JRenderer::ClipPolygon clipped;
+
+        for(int face = startFace; face < endFace; ++face) {
+            const uint* indices = &indexBuffer[face * 3];
+            const unsigned int codes[3] = { draw_call.vertex_outcodes[indices[0]], draw_call.vertex_outcodes[indices[1]],
+                                            draw_call.vertex_outcodes[indices[2]] };
+            if((codes[0] & codes[1] & codes[2] & CLIP_REJECT_MASK) != 0)
+                continue;
+            for(int i = 0; i < 3; ++i)
+                v[i] = draw_call.transformed_vertices[indices[i]];
+            //triangles inside the near/far planes and the guard band are rasterized as they are
+            JShadingPipeline::VertexData* polygon = v;
+            int num_vertices = 3;
+            if(((codes[0] | codes[1] | codes[2]) & CLIP_REQUIRED_MASK) != 0) {
+                num_vertices = JRenderer::clipingSutherlandHodgeman(v[0], v[1], v[2], draw_call.near, draw_call.far, clipped);
+                polygon = clipped.vertices;
+            }
+            if(num_vertices == 0)
+                continue;
+
+            for(int i = 0; i < num_vertices; ++i) {
+                JShadingPipeline::VertexData::prePerspCorrection(polygon[i]);
+                polygon[i].cpos *= polygon[i].rhw;
+                JShadingPipeline::VertexData::snapScreenPos(polygon[i], glm::vec2(draw_call.viewport_matrix * polygon[i].cpos), draw_call.subpixel_bits);
+            }
+            for(int i = 0; i < num_vertices - 2; ++i) {
+                if(faceCulling(polygon[0].fpos, polygon[i + 1].fpos, polygon[i + 2].fpos, draw_call.shading_state.cullFaceMode))
+                    continue;
+                emit(polygon[0], polygon[i + 1], polygon[i + 2]);
+            }
+        }
+    }
+
+    /**
+     * @brief the draws of a pass flattened into one triangle stream, faces are numbered across the draws and the
+     * workers look their draw up by id. Every draw keeps a copy of the shading state and a clone of the shader (shared by
+     * the draws of one material), so
+     * the submeshes of all meshes are transformed, rasterized and shaded together instead of one after another
+     */
+    class FrameStream final {
+    public:
+        FrameStream() : first_faces_(1, 0) {}
+
+        //the shader of draw_call is replaced by shader, which the stream keeps alive
+        void addDraw(const DrawcallSetting& draw_call, const JShadingPipeline::ptr& shader) {
+            const int faceNum = (int)(draw_call.index_buffer.size() / 3);
+            if(faceNum == 0)
+                return;
+            draws_.push_back(draw_call);
+            draws_.back().shader_handler = shader.get();
+            shaders_.push_back(shader);
+            first_faces_.push_back(first_faces_.back() + faceNum);
+            first_vertices_.push_back(num_vertices_);
+            num_vertices_ += draw_call.vertex_streams.count;
+        }
+
+        void clear() {
+            draws_.clear();
+            shaders_.clear();
+            first_faces_.assign(1, 0);
+            first_vertices_.clear();
+            num_vertices_ = 0;
+        }
+
+        int getDrawNum() const { return (int)draws_.size(); }
+        int getFaceNum() const { return first_faces_.back(); }
+        const DrawcallSetting& getDraw(const int& draw) const { return draws_[draw]; }
+        //stream index of the first face of draw, getFaceNum() for getDrawNum()
+        int getFirstFace(const int& draw) const { return first_faces_[draw]; }
+        //the draw stream face belongs to
+        int findDraw(const int& face) const {
+            return (int)(std::upper_bound(first_faces_.begin(), first_faces_.end(), face) - first_faces_.begin()) - 1;
+        }
+
+        /**
+         * @brief post-transform pass of all draws: every vertex of the vertex streams is fetched, shaded and
+         * classified against the clipping planes exactly once, no matter how many faces share it.
+         * The vertex batches of all draws go through one parallel loop
+         */
+        void transformVertices() {
+            transformed_vertices_.resize(num_vertices_);
+            vertex_outcodes_.resize(num_vertices_);
+            vertex_batches_.clear();
+            for(size_t d = 0; d < draws_.size(); ++d) {
+                auto& draw_call = draws_[d];
+                draw_call.transformed_vertices = transformed_vertices_.data() + first_vertices_[d];
+                draw_call.vertex_outcodes = vertex_outcodes_.data() + first_vertices_[d];
+                for(size_t v = 0; v < draw_call.vertex_streams.count; v += VERTEX_BATCH_SIZE)
+                    vertex_batches_.push_back(std::make_pair((int)d, v));
+            }
+            parallelLoop((size_t)0, vertex_batches_.size(), [&](const size_t& b) {
+                const int d = vertex_batches_[b].first;
+                const auto& draw_call = draws_[d];
+                const size_t begin = vertex_batches_[b].second;
+                const size_t end = std::min(begin + VERTEX_BATCH_SIZE, draw_call.vertex_streams.count);
+                const size_t offset = first_vertices_[d] + begin;
+                draw_call.shader_handler -> vertexShaderBatch(draw_call.vertex_streams.subview(begin, end), transformed_vertices_.data() + offset);
+                computeOutcodes(transformed_vertices_.data() + offset, (int)(end - begin), draw_call.near, draw_call.far,
+                    vertex_outcodes_.data() + offset);
+            });
+        }
+
+        /**
+         * @brief calls process(draw, startFace, endFace) for the part of the stream faces [startFace, endFace)
+         * inside each draw, in stream order and with faces numbered inside the draw
+         */
+        template<typename ProcessFunction>
+        void forEachDrawRange(const int& startFace, const int& endFace, const ProcessFunction& process) const {
+            for(int d = findDraw(startFace); d < getDrawNum() && first_faces_[d] < endFace; ++d) {
+                const int begin = std::max(startFace, first_faces_[d]);
+                const int end = std::min(endFace, first_faces_[d + 1]);
+                process(d, begin - first_faces_[d], end - first_faces_[d]);
+            }
+        }
+
+    private:
+        vector<DrawcallSetting> draws_;
+        vector<JShadingPipeline::ptr> shaders_;
+        vector<int> first_faces_; //prefix sums of the face numbers, getDrawNum() + 1 entries
+        vector<size_t> first_vertices_; //offsets of the draws into the post-transform cache
+        size_t num_vertices_ = 0;
+        //post-transform vertex cache of all draws, reused between passes
+        vector<JShadingPipeline::VertexData> transformed_vertices_;
+        vector<unsigned int> vertex_outcodes_;
+        vector<std::pair<int, size_t>> vertex_batches_; //(draw, first vertex)
+    };
+
+    template<int N>
     class TBBVertexRastFilter final {
     private:
-        int batchSize;
-        const int startIndex;
         const int overIndex;
-        const DrawcallSetting& draw_call;
-        static atomic<int> currIndex; //原子变量
+        const FrameStream& stream;
+        atomic<int>& currIndex; //原子变量, owned by the caller so that concurrent pipelines do not share it
         //创建std::atomic<T> XXX;
         //读取T xxx = XXX.load();
         //修改XXX.store(a);
         //原子操作函数: exchange(), compare_exchange_weak(), compare_exchange_strong(), fetch_add(), fetch_sub()
         //ref: https://www.runoob.com/cplusplus/cpp-multithreading.html
-        FragmentCache& fragment_cache;
+        FragmentCache<N>& fragment_cache;
+        FreeSlots& free_slots;
     public:
-        explicit TBBVertexRastFilter(int bs, int startIdx, int overIdx, const DrawcallSetting& drawcall, FragmentCache& cache) :
-        batchSize(bs), startIndex(startIdx), overIndex(overIdx), draw_call(drawcall), fragment_cache(cache) {
+        explicit TBBVertexRastFilter(atomic<int>& nextIdx, int startIdx, int overIdx, const FrameStream& frame_stream, FragmentCache<N>& cache, FreeSlots& slots) :
+        overIndex(overIdx), stream(frame_stream), currIndex(nextIdx), fragment_cache(cache), free_slots(slots) {
             currIndex.store(startIdx);
         }
         /*
@@ -98,158 +359,500 @@ namespace JackalRenderer {
         int operator()(tbb::flow_control& fc) const {
             int faceIndex = 0;
             {
-                if((faceIndex = currIndex.fetch_add(1) >= overIndex)) {
+                if((faceIndex = currIndex.fetch_add(1)) >= overIndex) {
                     fc.stop();
                     return -1;
                 }
             }
-            int order = faceIndex - startIndex; //当前面次序
-            faceIndex *= 3;
-
-            JShadingPipeline::VertexData v[3];
-            const auto& indexBuffer = draw_call.index_buffer;
-            const auto& vertexBuffer = draw_call.vertex_buffer;
-#pragma unroll 3
-            for(int i = 0; i < 3; ++i) {
-                v[i].pos = vertexBuffer[indexBuffer[faceIndex + i]].vpostions;
-                v[i].nor = vertexBuffer[indexBuffer[faceIndex + i]].vnormals;
-                v[i].tex = vertexBuffer[indexBuffer[faceIndex + i]].vtexcoords;
-                v[i].tbn[0] = vertexBuffer[indexBuffer[faceIndex + i]].vtangent;
-                v[i].tbn[1] = vertexBuffer[indexBuffer[faceIndex + i]].vbitanget;
-            }
-            draw_call.shader_handler -> vertexShader(v[0]);
-            draw_call.shader_handler -> vertexShader(v[1]);
-            draw_call.shader_handler -> vertexShader(v[2]);
-
-            vector<JShadingPipeline::VertexData> clipped_vertices;
-            clipped_vertices = JRenderer::clipingSutherlandHodgeman(v[0], v[0], v[2], draw_call.near, draw_call.far);
-            if(clipped_vertices.empty())
-                return -1;
-
-            for(auto& vertex : clipped_vertices) {
-                JShadingPipeline::VertexData::prePerspCorrection(vertex);
-                vertex.cpos *= vertex.rhw;
+            //the pipeline has no more tokens than the cache has slots, so a slot is always free,
+            //anything else would let two faces share a slot
+            int slot = 0;
+            if(!free_slots.try_pop(slot))
+                throw std::logic_error("JRenderer: no free fragment cache slot, more faces in flight than slots");
+            auto& face = fragment_cache[slot];
+            face.draw = stream.findDraw(faceIndex);
+            const DrawcallSetting& draw_call = stream.getDraw(face.draw);
+            const int drawFace = faceIndex - stream.getFirstFace(face.draw);
+            const glm::ivec2 screenMax(draw_call.frame_buffer -> getWidth() - 1, draw_call.frame_buffer -> getHeight() - 1);
+            processFaces(draw_call, drawFace, drawFace + 1, [&](const JShadingPipeline::VertexData& v0,
+                const JShadingPipeline::VertexData& v1, const JShadingPipeline::VertexData& v2) {
+                JShadingPipeline::TriangleSetup triangle;
+                if(!triangle.setup(v0, v1, v2, !draw_call.depth_only))
+                    return;
+                face.triangles.push_back(triangle);
+                JShadingPipeline::rasterizeFillEdgeFunction<N>(triangle, (int)face.triangles.size() - 1, glm::ivec2(0), screenMax, face.quads);
+            });
+            return slot;
+        }
+    };
+
+    /**
+     * @brief the depth prepass of one quad, depth test and depth write of its covered samples.
+     * Nothing is interpolated or shaded, the per-pixel lock is only taken when a mutex buffer is given
+     */
+    template<int N>
+    static void writeQuadDepth(const DrawcallSetting& drawcall_setting, const JShadingPipeline::QuadRecord<N>& quad,
+        FramebufferMutex* framebuffer_mutex) {
+        auto& framebuffer = drawcall_setting.frame_buffer;
+        for(int p = 0; p < 4; ++p) {
+            JTMaskPixelSampler<N> coverage(quad.coverage >> (p * N));
+            if(coverage.empty())
+                continue;
+            const glm::ivec2 fragCoord = quad.spos + glm::ivec2(p & 1, p >> 1);
+            JTDepthPixelSampler<N> depth(0.0f);
+            MutexType::scoped_lock lock;
+            if(framebuffer_mutex != nullptr)
+                lock.acquire(framebuffer_mutex -> getLocker(fragCoord.x, fragCoord.y));
+            for(int s = 0; s < N; ++s) {
+                if(!coverage[s])
+                    continue;
+                depth[s] = quad.depth[p * N + s];
+                if(framebuffer -> readDepth(fragCoord.x, fragCoord.y, s) >= depth[s])
+                    coverage.reset(s);
             }
+            if(!coverage.empty())
+                framebuffer -> writeDepthWithMask<N>(fragCoord.x, fragCoord.y, depth, coverage);
+        }
+    }
 
-            int num_vertices = clipped_vertices.size();
-            for(int i = 0; i < num_vertices - 2; ++i) {
-                JShadingPipeline::VertexData vertex[3] = {clipped_vertices[0], clipped_vertices[i + 1], clipped_vertices[i + 2]};
-                //TODO testing offset glm::vec4(0.5f)
-                vertex[0].spos = glm::ivec2(draw_call.viewport_matrix * vertex[0].cpos + glm::vec4(0.5f));
-                vertex[1].spos = glm::ivec2(draw_call.viewport_matrix * vertex[1].cpos + glm::vec4(0.5f));
-                vertex[2].spos = glm::ivec2(draw_call.viewport_matrix * vertex[2].cpos + glm::vec4(0.5f));
+    /**
+     * @brief depth test, fragment shading and framebuffer writes of one quad,
+     * the per-pixel lock is only taken when a mutex buffer is given (J_RASTER_PIXEL_LOCK).
+     * Fragments are depth tested before shading (early-z) unless the shading pipeline asks for late
+     * depth testing, fragments without surviving samples are not shaded. Attributes are only
+     * interpolated from the triangle setup for the fragments that survive, which are then shaded
+     * as one quad by the pipeline.
+     * @tparam N sampling points per pixel of the framebuffer
+     */
+    template<int N>
+    static void shadeQuadFragments(const DrawcallSetting& drawcall_setting, const JShadingPipeline::TriangleSetup& triangle,
+        const JShadingPipeline::QuadRecord<N>& quad, FramebufferMutex* framebuffer_mutex) {
+        if(drawcall_setting.depth_only) {
+            writeQuadDepth<N>(drawcall_setting, quad, framebuffer_mutex);
+            return;
+        }
+        auto& framebuffer = drawcall_setting.frame_buffer;
+        const auto& shadingState = drawcall_setting.shading_state;
+        constexpr int samplingNum = N;
+        //coverage and depth of the sampling points of every fragment in the quad
+        JTMaskPixelSampler<N> coverages[4];
+        JTDepthPixelSampler<N> coverageDepths[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        JShadingPipeline::QuadFragments block;
+        const bool depthTest = shadingState.depthTestMode == JDepthTestMode::J_DEPTH_TEST_ENABLE;
+        const bool depthEqual = shadingState.depthCompareMode == JDepthCompareMode::J_DEPTH_COMPARE_EQUAL;
+        const bool earlyDepthTest = depthTest && !drawcall_setting.shader_handler -> requiresLateDepthTest();
 
-                if(FaceCulling(vertex[0].spos, vertex[1].spos, vertex[2].spos, draw_call.shading_state.cullFaceMode))
+        //clears the coverage of failed samples, returns the number of surviving samples
+        auto depth_test_func = [&](const int& p) -> int {
+            auto& coverage = coverages[p];
+            const auto& fragCoord = block.fragments[p].spos;
+            const auto& coverageDepth = coverageDepths[p];
+#pragma unroll
+            for(int s = 0; s < samplingNum; ++s) {
+                if(!coverage[s])
                     continue;
-                JShadingPipeline::rasterizeFillEdgeFunction(vertex[0], vertex[1], vertex[2], draw_call.frame_buffer -> getWidth(), draw_call.frame_buffer -> getHeight(), fragment_cache[order]);
+                const float depth = framebuffer -> readDepth(fragCoord.x, fragCoord.y, s);
+                if(depthEqual ? depth != coverageDepth[s] : depth >= coverageDepth[s])
+                    coverage.reset(s);
+            }
+            return coverage.count();
+        };
+
+        //late depth test and framebuffer writes of the shaded fragment p, its G-buffer texel instead of the color if given
+        auto write_func = [&](const int& p, const glm::vec4& fragColor, const JGBufferTexel* texel) {
+            auto& coverage = coverages[p];
+            const auto& fragCoord = block.fragments[p].spos;
+            //防止(x,y)处的深度缓冲被同时访问
+            MutexType::scoped_lock lock;
+            if(framebuffer_mutex != nullptr)
+                lock.acquire(framebuffer_mutex -> getLocker(fragCoord.x, fragCoord.y));
+
+            //other workers may have written nearer depth since the early test, so the locked path tests again
+            if(earlyDepthTest && framebuffer_mutex != nullptr && depth_test_func(p) == 0)
+                return;
+
+            if(depthTest && !earlyDepthTest && depth_test_func(p) == 0)
+                return;
+
+            if(shadingState.alphaBlendingMode == JAlphaBlendingMode::J_ALPHA_TO_COVERAGE && samplingNum >= 4) {
+                //emissive or HDR colors may carry an alpha above 1, which covers every sampling point
+                int num_cancle = samplingNum - int(samplingNum * glm::clamp(fragColor.a, 0.0f, 1.0f));
+                if(num_cancle >= samplingNum)
+                    return;
+                //drop the first num_cancle sampling points
+                coverage &= JTMaskPixelSampler<N>(~0u << num_cancle);
+                if(coverage.empty())
+                    return;
             }
-            return order;
+
+            if(texel != nullptr)
+                framebuffer -> writeGBufferWithMask<N>(fragCoord.x, fragCoord.y, *texel, coverage);
+            else switch (shadingState.alphaBlendingMode) {
+                case JAlphaBlendingMode::J_ALPHA_DISABLE:
+
+                case JAlphaBlendingMode::J_ALPHA_TO_COVERAGE:
+                    framebuffer -> writeColorWithMask<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+                    break;
+                case JAlphaBlendingMode::J_ALPHA_BLENDING:
+                    framebuffer -> writeColorWithMaskAlphaBlending<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+                    break;
+                case JAlphaBlendingMode::J_ALPHA_ORDER_INDEPENDENT:
+                    //accumulated only, the transparent surfaces never occlude each other
+                    framebuffer -> writeOITWithMask<N>(fragCoord.x, fragCoord.y, fragColor, coverageDepths[p], coverage);
+                    return;
+                default:
+                    framebuffer -> writeColorWithMask<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+                    break;
+            }
+
+            if(shadingState.depthWriteMode == JDepthWriteMode::J_DEPTH_WRITE_ENABLE)
+                framebuffer -> writeDepthWithMask<N>(fragCoord.x, fragCoord.y, coverageDepths[p], coverage);
+        };
+
+        //unpack the coverage and depth of the record
+        unsigned int pixelMask = 0;
+        for(int p = 0; p < 4; ++p) {
+            auto& fragment = block.fragments[p];
+            coverages[p] = JTMaskPixelSampler<N>(quad.coverage >> (p * samplingNum));
+            fragment.spos = glm::ivec2(-1);
+            if(coverages[p].empty())
+                continue;
+            fragment.spos = quad.spos + glm::ivec2(p & 1, p >> 1);
+            for(int s = 0; s < samplingNum; ++s)
+                coverageDepths[p][s] = coverages[p][s] ? quad.depth[p * samplingNum + s] : 0.0f;
+            pixelMask |= 1u << p;
         }
 
-    private:
-        static inline bool FaceCulling(const glm::ivec2& v0, const glm::ivec2& v1, const glm::ivec2& v2, JCullFaceMode mode) {
-            if(mode == JCullFaceMode::J_CULL_DISABLE)
-                return false;
-            auto e1 = v1 - v0;
-            auto e2 = v2 - v0;
-            int orient = e1.x * e2.y - e1.y * e2.x;
-            //orient > 0 背面， < 0 正面
-            return (mode == JCullFaceMode::J_CULL_BACK) ? orient > 0 : orient < 0;
+        if(earlyDepthTest) {
+#pragma unroll 4
+            for(int i = 0; i < 4; ++i) {
+                auto& fragment = block.fragments[i];
+                if(fragment.spos.x == -1)
+                    continue;
+                MutexType::scoped_lock lock;
+                if(framebuffer_mutex != nullptr)
+                    lock.acquire(framebuffer_mutex -> getLocker(fragment.spos.x, fragment.spos.y));
+                if(depth_test_func(i) == 0)
+                    pixelMask &= ~(1u << i);
+            }
+            if(pixelMask == 0)
+                return;
         }
-    };
 
-    atomic<int> TBBVertexRastFilter::currIndex;
+        //failed fragments stay helper fragments, they are neither interpolated nor shaded
+        triangle.interpolateQuad(quad.spos.x, quad.spos.y, pixelMask, block);
+        block.aftPerspCorrectionforBlocks();
+        //the surviving fragments are shaded together, before any pixel lock is taken
+        if(drawcall_setting.geometry_pass) {
+            JGBufferTexel texels[4];
+            drawcall_setting.shader_handler -> fragmentSurfaceQuad(block, pixelMask, texels);
+            for(int p = 0; p < 4; ++p) {
+                if(pixelMask & (1u << p))
+                    write_func(p, glm::vec4(0.0f, 0.0f, 0.0f, texels[p].alpha), &texels[p]);
+            }
+            return;
+        }
+        glm::vec4 fragColors[4];
+        drawcall_setting.shader_handler -> fragmentShaderQuad(block, pixelMask, fragColors);
+#pragma unroll 4
+        for(int p = 0; p < 4; ++p) {
+            if(pixelMask & (1u << p))
+                write_func(p, fragColors[p], nullptr);
+        }
+    }
 
+    template<int N>
     class TBBFragmentFilter final {
     private:
-        int batchSize;
-        const DrawcallSetting& drawcall_setting_;
-        FragmentCache& fragment_cache_;
+        const FrameStream& stream_;
+        FragmentCache<N>& fragment_cache_;
         FramebufferMutex& framebuffer_mutex_;
+        FreeSlots& free_slots_;
+        StageCounters& counters_;
     public:
-        explicit TBBFragmentFilter(int bs, const DrawcallSetting& drawcall, FragmentCache& cache, FramebufferMutex& fbmutex) :
-        batchSize(bs), drawcall_setting_(drawcall), fragment_cache_(cache), framebuffer_mutex_(fbmutex) {}
+        explicit TBBFragmentFilter(const FrameStream& frame_stream, FragmentCache<N>& cache, FramebufferMutex& fbmutex, FreeSlots& slots,
+            StageCounters& counters) :
+        stream_(frame_stream), fragment_cache_(cache), framebuffer_mutex_(fbmutex), free_slots_(slots), counters_(counters) {}
 
         void operator()(int idx) const {
-            if(idx == -1 || fragment_cache_[idx].empty())
+            if(idx == -1)
                 return;
-            auto fragment_func = [&](JShadingPipeline::FragmentData& fragment, const glm::vec2& dUVdx, const glm::vec2& dUVdy) {
-                if(fragment.spos.x == -1)
-                    return;
-                auto& coverage = fragment.coverage;
-                const auto& fragCoord = fragment.spos;
-                auto& framebuffer = drawcall_setting_.frame_buffer;
-                const auto& shadingState = drawcall_setting_.shading_state;
-                //防止(x,y)处的深度缓冲被同时访问
-                MutexType::scoped_lock lock(framebuffer_mutex_.getLocker(fragCoord.x, fragCoord.y));
-
-                const int samplingNum = JMaskPixelSampler::getSamplingNum();
-
-                int num_failed = 0;
-                if(shadingState.depthTestMode == JDepthTestMode::J_DEPTH_TEST_ENABLE) {
-                    const auto& coverageDepth = fragment.coverageDepth;
-#pragma unroll
-                    for(int s = 0; s < samplingNum; ++s) {
-                        if(coverage[s] == 1 && framebuffer -> readDepth(fragCoord.x, fragCoord.y, s) >= coverageDepth[s]) {
-                            coverage[s] = 0;
-                            ++num_failed;
-                        }else if(coverage[s] == 0)
-                            ++num_failed;
-                    }
-                }
+            auto& face = fragment_cache_[idx];
+            const DrawcallSetting& drawcall_setting = stream_.getDraw(face.draw);
+            parallelLoop((size_t)0, face.quads.size(), [&](const size_t& f) {
+                const auto& quad = face.quads[f];
+                shadeQuadFragments<N>(drawcall_setting, face.triangles[quad.triangle], quad, &framebuffer_mutex_);
+            }, JExecutionPolicy::J_PARALLEL);
+            auto& counters = counters_.local();
+            counters.triangles += face.triangles.size();
+            counters.quads += face.quads.size();
+
+            face.triangles.clear();
+            face.quads.clear();
+            free_slots_.push(idx);
+        }
+    };
+
+    /**
+     * @brief sort-middle binning: post-clip triangles are sorted into RASTER_TILE_SIZE screen tiles,
+     * afterwards every tile is rasterized, depth tested and shaded by exactly one worker, so the
+     * framebuffer needs no locks. Triangles are produced in chunks of JPipelineTuning::chunkFaces faces of the frame stream,
+     * which may span several draws, and each chunk keeps its own bins, walking the chunks in order restores the
+     * primitive order per tile.
+     */
+    class TileBinner final {
+    public:
+        struct Chunk {
+            vector<JShadingPipeline::TriangleSetup> triangles; //set up once, rasterized by every tile they touch
+            vector<int> triangle_draws; //draw of each triangle in the frame stream
+            vector<glm::ivec2> tile_refs; //(tile, triangle) pairs before sorting
+            vector<int> tile_offsets; //CSR offsets into tile_items, tiles + 1 entries
+            vector<int> tile_items; //triangle indices sorted by tile
+        };
+
+        TileBinner() = default;
+
+        void reset(int width, int height, int numChunks) {
+            screen_width_ = width;
+            screen_height_ = height;
+            tiles_x_ = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+            tiles_y_ = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+            //chunks are only ever grown so that their buffers are reused between drawcalls
+            if((int)chunks_.size() < numChunks)
+                chunks_.resize(numChunks);
+            num_chunks_ = numChunks;
+        }
 
-                glm::vec4 fragColor;
-                drawcall_setting_.shader_handler -> fragmentShader(fragment, fragColor, dUVdx, dUVdy);
+        int getTileNum() const { return tiles_x_ * tiles_y_; }
+        //triangles binned into the chunks
+        size_t getTriangleNum() const {
+            size_t num = 0;
+            for(int c = 0; c < num_chunks_; ++c)
+                num += chunks_[c].triangles.size();
+            return num;
+        }
 
-                if(shadingState.alphaBlendingMode == JAlphaBlendingMode::J_ALPHA_TO_COVERAGE && samplingNum >= 4) {
-                    int num_cancle = samplingNum - int(samplingNum * fragColor.a);
-                    if(num_cancle == samplingNum)
+        //bins the stream faces [startFace, endFace)
+        void binFaces(const FrameStream& stream, int chunkIdx, int startFace, int endFace) {
+            auto& chunk = chunks_[chunkIdx];
+            chunk.triangles.clear();
+            chunk.triangle_draws.clear();
+            chunk.tile_refs.clear();
+            stream.forEachDrawRange(startFace, endFace, [&](const int& draw, const int& drawStart, const int& drawEnd) {
+                const DrawcallSetting& draw_call = stream.getDraw(draw);
+                processFaces(draw_call, drawStart, drawEnd, [&](const JShadingPipeline::VertexData& v0,
+                    const JShadingPipeline::VertexData& v1, const JShadingPipeline::VertexData& v2) {
+                    JShadingPipeline::TriangleSetup triangle;
+                    if(!triangle.setup(v0, v1, v2, !draw_call.depth_only))
                         return;
-                    for(int c = 0; c < num_cancle; ++c)
-                        coverage[c] = 0;
-                }
+                    glm::ivec2 boundingMin = glm::max(triangle.boundingMin, glm::ivec2(0));
+                    glm::ivec2 boundingMax = glm::min(triangle.boundingMax, glm::ivec2(screen_width_ - 1, screen_height_ - 1));
+                    if(boundingMin.x > boundingMax.x || boundingMin.y > boundingMax.y)
+                        return;
+                    int triangleIdx = chunk.triangles.size();
+                    chunk.triangles.push_back(triangle);
+                    chunk.triangle_draws.push_back(draw);
+                    glm::ivec2 tileMin = boundingMin / RASTER_TILE_SIZE;
+                    glm::ivec2 tileMax = boundingMax / RASTER_TILE_SIZE;
+                    for(int ty = tileMin.y; ty <= tileMax.y; ++ty)
+                        for(int tx = tileMin.x; tx <= tileMax.x; ++tx)
+                            chunk.tile_refs.push_back(glm::ivec2(ty * tiles_x_ + tx, triangleIdx));
+                });
+            });
+            //counting sort by tile keeps the triangle order inside each tile
+            const int numTiles = getTileNum();
+            chunk.tile_offsets.assign(numTiles + 1, 0);
+            for(const auto& ref : chunk.tile_refs)
+                ++chunk.tile_offsets[ref.x + 1];
+            for(int t = 0; t < numTiles; ++t)
+                chunk.tile_offsets[t + 1] += chunk.tile_offsets[t];
+            chunk.tile_items.resize(chunk.tile_refs.size());
+            vector<int> cursor(chunk.tile_offsets.begin(), chunk.tile_offsets.end() - 1);
+            for(const auto& ref : chunk.tile_refs)
+                chunk.tile_items[cursor[ref.x]++] = ref.y;
+        }
 
-                switch (shadingState.alphaBlendingMode) {
-                    case JAlphaBlendingMode::J_ALPHA_DISABLE:
-
-                    case JAlphaBlendingMode::J_ALPHA_TO_COVERAGE:
-                        framebuffer -> writeColorWithMask(fragCoord.x, fragCoord.y, fragColor, coverage);
-                        break;
-                    case JAlphaBlendingMode::J_ALPHA_BLENDING:
-                        framebuffer -> writeColorWithMaskAlphaBlending(fragCoord.x, fragCoord.y, fragColor, coverage);
-                        break;
-                    default:
-                        framebuffer -> writeColorWithMask(fragCoord.x, fragCoord.y, fragColor, coverage);
-                        break;
+        //returns the number of quads rasterized
+        template<int N>
+        size_t renderTile(const FrameStream& stream, int tileIdx, vector<JShadingPipeline::QuadRecord<N>>& quads) const {
+            size_t numQuads = 0;
+            const glm::ivec2 tileMin((tileIdx % tiles_x_) * RASTER_TILE_SIZE, (tileIdx / tiles_x_) * RASTER_TILE_SIZE);
+            const glm::ivec2 tileMax(glm::min(tileMin.x + RASTER_TILE_SIZE, screen_width_) - 1,
+                glm::min(tileMin.y + RASTER_TILE_SIZE, screen_height_) - 1);
+            for(int c = 0; c < num_chunks_; ++c) {
+                const auto& chunk = chunks_[c];
+                for(int i = chunk.tile_offsets[tileIdx]; i < chunk.tile_offsets[tileIdx + 1]; ++i) {
+                    const auto& triangle = chunk.triangles[chunk.tile_items[i]];
+                    const DrawcallSetting& draw_call = stream.getDraw(chunk.triangle_draws[chunk.tile_items[i]]);
+                    //the tile owns its hierarchical z blocks, so it may test and refresh them without locks
+                    JFrameBuffer* hiZ = draw_call.shading_state.depthTestMode == JDepthTestMode::J_DEPTH_TEST_ENABLE ? draw_call.frame_buffer : nullptr;
+                    const bool depthWrite = draw_call.shading_state.depthWriteMode == JDepthWriteMode::J_DEPTH_WRITE_ENABLE;
+                    const bool depthEqual = draw_call.shading_state.depthCompareMode == JDepthCompareMode::J_DEPTH_COMPARE_EQUAL;
+                    if(hiZ != nullptr) {
+                        const float nearestDepth = glm::max(triangle.vertexRhw[0], glm::max(triangle.vertexRhw[1], triangle.vertexRhw[2]));
+                        const glm::ivec2 boundingMin = glm::max(triangle.boundingMin, tileMin);
+                        const glm::ivec2 boundingMax = glm::min(triangle.boundingMax, tileMax);
+                        if(hiZ -> isHiZOccluded(boundingMin, boundingMax, nearestDepth, depthEqual))
+                            continue;
+                    }
+                    quads.clear();
+                    JShadingPipeline::rasterizeFillEdgeFunction<N>(triangle, chunk.tile_items[i], tileMin, tileMax, quads, hiZ, depthEqual);
+                    numQuads += quads.size();
+                    for(const auto& quad : quads) {
+                        shadeQuadFragments<N>(draw_call, triangle, quad, nullptr);
+                        if(depthWrite)
+                            draw_call.frame_buffer -> invalidateHiZ(quad.spos.x, quad.spos.y);
+                    }
                 }
+            }
+            return numQuads;
+        }
 
-                if(shadingState.depthWriteMode == JDepthWriteMode::J_DEPTH_WRITE_ENABLE)
-                    framebuffer -> writeDepthWithMask(fragCoord.x, fragCoord.y, fragment.coverageDepth, coverage);
-            };
+    private:
+        vector<Chunk> chunks_;
+        int num_chunks_ = 0;
+        int tiles_x_ = 0, tiles_y_ = 0;
+        int screen_width_ = 0, screen_height_ = 0;
+    };
 
-            parallelLoop((size_t)0, (size_t)fragment_cache_[idx].size(), [&](const size_t& f) {
-                auto& block = fragment_cache_[idx][f];
-                block.aftPerspCorrectionforBlocks();
-                glm::vec2 dUVdx(block.dUdx(), block.dVdx());
-                glm::vec2 dUVdy(block.dUdy(), block.dVdy());
-                fragment_func(block.fragments[0], dUVdx, dUVdy);
-                fragment_func(block.fragments[1], dUVdx, dUVdy);
-                fragment_func(block.fragments[2], dUVdx, dUVdy);
-                fragment_func(block.fragments[3], dUVdx, dUVdy);
-            }, JExecutionPolicy::J_PARALLEL);
+    /**
+     * @brief sort-last rendering: the faces of the frame stream are handed out in chunks of JPipelineTuning::sortLastFaces,
+     * each worker thread renders whole triangles into a framebuffer of its own without any locks, and the framebuffers are
+     * merged into the back buffer by depth afterwards. The private framebuffers start with the depth of the back buffer,
+     * so only the samples a worker wrote can win the merge. Only valid for draws whose result does not depend on the order
+     * of their fragments, see JRenderer::renderFrameStream
+     */
+    class SortLastBuffers final {
+    public:
+        struct Target {
+            JFrameBuffer::ptr buffer;
+            bool seeded = false; //holds the back buffer depth of the current run
+        };
+
+        //starts a run, the framebuffers are seeded again on their next use
+        void begin() {
+            for(auto& target : targets_)
+                target.seeded = false;
+        }
 
-            fragment_cache_[idx].clear();
+        //the framebuffer of the calling worker, created and seeded with the depth of back_buffer on first use
+        JFrameBuffer* local(const JFrameBuffer& back_buffer) {
+            auto& target = targets_.local();
+            if(target.buffer == nullptr || target.buffer -> getWidth() != back_buffer.getWidth()
+                || target.buffer -> getHeight() != back_buffer.getHeight() || target.buffer -> getSamplingNum() != back_buffer.getSamplingNum())
+                target.buffer = std::make_shared<JFrameBuffer>(back_buffer.getWidth(), back_buffer.getHeight(), back_buffer.getSamplingNum());
+            if(!target.seeded) {
+                target.buffer -> copyDepth(back_buffer);
+                target.seeded = true;
+            }
+            return target.buffer.get();
+        }
+
+        //merges the framebuffers used in the run into back_buffer, only their depth if withColor is false
+        void composite(JFrameBuffer& back_buffer, const bool& withColor) {
+            vector<const JFrameBuffer*> sources;
+            for(const auto& target : targets_) {
+                if(target.seeded)
+                    sources.push_back(target.buffer.get());
+            }
+            back_buffer.compositeNearest(sources, withColor);
         }
+
+        /**
+         * @brief renders the stream faces [startFace, endFace) into target, the triangles are shaded right after
+         * their setup with target as the framebuffer of their draw
+         * @return the number of quads rasterized, triangles counts the triangles set up
+         */
+        template<int N>
+        static size_t renderFaces(const FrameStream& stream, const int& startFace, const int& endFace, JFrameBuffer* target,
+            vector<JShadingPipeline::QuadRecord<N>>& quads, size_t& triangles) {
+            size_t numQuads = 0;
+            const glm::ivec2 screenMax(target -> getWidth() - 1, target -> getHeight() - 1);
+            stream.forEachDrawRange(startFace, endFace, [&](const int& draw, const int& drawStart, const int& drawEnd) {
+                DrawcallSetting draw_call(stream.getDraw(draw));
+                draw_call.frame_buffer = target;
+                processFaces(draw_call, drawStart, drawEnd, [&](const JShadingPipeline::VertexData& v0,
+                    const JShadingPipeline::VertexData& v1, const JShadingPipeline::VertexData& v2) {
+                    JShadingPipeline::TriangleSetup triangle;
+                    if(!triangle.setup(v0, v1, v2, !draw_call.depth_only))
+                        return;
+                    const glm::ivec2 boundingMin = glm::max(triangle.boundingMin, glm::ivec2(0));
+                    const glm::ivec2 boundingMax = glm::min(triangle.boundingMax, screenMax);
+                    if(boundingMin.x > boundingMax.x || boundingMin.y > boundingMax.y)
+                        return;
+                    ++triangles;
+                    //the worker owns target, so its hierarchical z is tested and refreshed without locks
+                    const float nearestDepth = glm::max(triangle.vertexRhw[0], glm::max(triangle.vertexRhw[1], triangle.vertexRhw[2]));
+                    if(target -> isHiZOccluded(boundingMin, boundingMax, nearestDepth))
+                        return;
+                    quads.clear();
+                    JShadingPipeline::rasterizeFillEdgeFunction<N>(triangle, 0, glm::ivec2(0), screenMax, quads, target);
+                    numQuads += quads.size();
+                    for(const auto& quad : quads) {
+                        shadeQuadFragments<N>(draw_call, triangle, quad, nullptr);
+                        target -> invalidateHiZ(quad.spos.x, quad.spos.y);
+                    }
+                });
+            });
+            return numQuads;
+        }
+
+    private:
+        tbb::enumerable_thread_specific<Target> targets_;
     };
 
-    JRenderer::JRenderer(int width, int height) : backBuffer(nullptr), frontBuffer(nullptr){
-        backBuffer = std::make_shared<JFrameBuffer>(width, height);
-        frontBuffer = std::make_shared<JFrameBuffer>(width, height);
+    /**
+     * @brief the scratch memory of JRenderer::renderFrameStream per sampling number, the fragment cache slots of the
+     * locked pipeline and the quad records of every worker. Each sampling number is only allocated once it is rendered
+     */
+    class RasterBuffers final {
+    public:
+        template<int N>
+        struct Buffers {
+            FragmentCache<N> fragment_cache;
+            tbb::enumerable_thread_specific<vector<JShadingPipeline::QuadRecord<N>>> tile_quads;
+        };
+
+        template<int N>
+        Buffers<N>& get() {
+            auto& buffers = slot(std::integral_constant<int, N>());
+            if(buffers == nullptr)
+                buffers = std::make_shared<Buffers<N>>();
+            return *buffers;
+        }
+
+    private:
+        shared_ptr<Buffers<1>>& slot(std::integral_constant<int, 1>) { return buffers1_; }
+        shared_ptr<Buffers<2>>& slot(std::integral_constant<int, 2>) { return buffers2_; }
+        shared_ptr<Buffers<4>>& slot(std::integral_constant<int, 4>) { return buffers4_; }
+        shared_ptr<Buffers<8>>& slot(std::integral_constant<int, 8>) { return buffers8_; }
+
+        shared_ptr<Buffers<1>> buffers1_;
+        shared_ptr<Buffers<2>> buffers2_;
+        shared_ptr<Buffers<4>> buffers4_;
+        shared_ptr<Buffers<8>> buffers8_;
+    };
+
+    JRenderer::JRenderer(int width, int height, int samplingNum) : backBuffer(nullptr), frontBuffer(nullptr){
+        if(samplingNum != 1 && samplingNum != 2 && samplingNum != 4 && samplingNum != 8)
+            throw std::invalid_argument("JRenderer: sampling number has to be 1, 2, 4 or 8");
+        backBuffer = std::make_shared<JFrameBuffer>(width, height, samplingNum);
+        frontBuffer = std::make_shared<JFrameBuffer>(width, height, samplingNum);
         renderedImg.resize(width * height * 3, 0);
         //ndc space -> screen space
         viewport_Matrix = JMathUtils::calcViewPortMatrix(width, height);
     }
 
+    void JRenderer::setSamplingNum(int samplingNum) {
+        if(samplingNum == getSamplingNum())
+            return;
+        if(samplingNum != 1 && samplingNum != 2 && samplingNum != 4 && samplingNum != 8)
+            throw std::invalid_argument("JRenderer: sampling number has to be 1, 2, 4 or 8");
+        //the render targets are recreated, their content is lost
+        backBuffer = std::make_shared<JFrameBuffer>(backBuffer -> getWidth(), backBuffer -> getHeight(), samplingNum);
+        frontBuffer = std::make_shared<JFrameBuffer>(frontBuffer -> getWidth(), frontBuffer -> getHeight(), samplingNum);
+    }
+
     void JRenderer::addDrawableMesh(JDrawableMesh::ptr mesh) {
         drawable_meshes_.push_back(mesh);
     }
@@ -284,17 +887,79 @@ namespace JackalRenderer {
         JShadingPipeline::setExposure(exposure);
     }
 
-    uint JRenderer::renderAllDrawableMeshes() {
+    void JRenderer::beginFrame() {
         if(shaderHandler == nullptr) {
             shaderHandler = std::make_shared<J3DShadingPipeline>();
         }
         shaderHandler -> setModelMatrix(model_Matrix);
         shaderHandler -> setViewProjectMatrix(project_Matrix * view_Matrix);
+        JShadingPipeline::compileLights(view_Matrix, project_Matrix, backBuffer -> getWidth(), backBuffer -> getHeight(),
+            frustumNearFar.x, frustumNearFar.y);
+        frame_stats_ = JPipelineStats();
+    }
 
+    uint JRenderer::renderAllDrawableMeshes() {
+        beginFrame();
+
+        //the draws of a pass are recorded into the frame stream and rendered at once, passes are the only barriers
         uint numTriangles = 0;
+        if(depth_prepass_ && !shaderHandler -> requiresLateDepthTest()) {
+            //only the depth, the triangles are counted when they are shaded
+            depth_only_pass_ = true;
+            for(size_t m = 0; m < drawable_meshes_.size(); ++m) {
+                if(isDepthPrepassMesh(m))
+                    recordDrawableMesh(m);
+            }
+            renderFrameStream();
+            depth_only_pass_ = false;
+            depth_prepassed_ = true;
+        }
+        if(shading_mode_ == JShadingMode::J_SHADING_DEFERRED && shaderHandler -> isDeferrable()) {
+            //the opaque meshes fill the G-buffer, which is lit once, blended meshes need the lit colors beneath them
+            backBuffer -> clearGBuffer();
+            geometry_pass_ = true;
+            for(size_t m = 0; m < drawable_meshes_.size(); ++m) {
+                if(drawable_meshes_[m] -> getAlphaBlendingMode() != JAlphaBlendingMode::J_ALPHA_BLENDING && !isOrderIndependentMesh(m))
+                    numTriangles += recordDrawableMesh(m);
+            }
+            renderFrameStream();
+            geometry_pass_ = false;
+            switch(backBuffer -> getSamplingNum()) {
+                case 1: lightGBuffer<1>(); break;
+                case 2: lightGBuffer<2>(); break;
+                case 4: lightGBuffer<4>(); break;
+                case 8: lightGBuffer<8>(); break;
+                default: break;
+            }
+            for(size_t m = 0; m < drawable_meshes_.size(); ++m) {
+                if(drawable_meshes_[m] -> getAlphaBlendingMode() == JAlphaBlendingMode::J_ALPHA_BLENDING)
+                    numTriangles += recordDrawableMesh(m);
+            }
+            renderFrameStream();
+        }else {
+            for(size_t m = 0; m < drawable_meshes_.size(); ++m) {
+                if(!isOrderIndependentMesh(m))
+                    numTriangles += recordDrawableMesh(m);
+            }
+            renderFrameStream();
+        }
+        //the order independent meshes are accumulated over everything else in one unordered pass, then composited
+        bool orderIndependent = false;
         for(size_t m = 0; m < drawable_meshes_.size(); ++m) {
-            numTriangles += renderAllDrawableMesh(m);
+            if(!isOrderIndependentMesh(m))
+                continue;
+            if(!orderIndependent)
+                backBuffer -> clearOIT();
+            orderIndependent = true;
+            numTriangles += recordDrawableMesh(m);
+        }
+        if(orderIndependent) {
+            renderFrameStream();
+            backBuffer -> resolveOIT();
         }
+        depth_prepassed_ = false;
+        if(adaptive_tuning_)
+            pipeline_tuner_.update(frame_stats_, tbb::this_task_arena::max_concurrency());
 
         backBuffer -> resolve();
         {
@@ -304,10 +969,73 @@ namespace JackalRenderer {
     }
 
     uint JRenderer::renderAllDrawableMesh(const size_t &idx) {
+        beginFrame();
+        //an order independent mesh is accumulated and composited on its own, as in renderAllDrawableMeshes
+        const bool orderIndependent = idx < drawable_meshes_.size() && isOrderIndependentMesh(idx);
+        if(orderIndependent)
+            backBuffer -> clearOIT();
+        const uint numTriangles = recordDrawableMesh(idx);
+        renderFrameStream();
+        if(orderIndependent)
+            backBuffer -> resolveOIT();
+        if(adaptive_tuning_)
+            pipeline_tuner_.update(frame_stats_, tbb::this_task_arena::max_concurrency());
+        return numTriangles;
+    }
+
+    bool JRenderer::calibratePipeline(const string& cachePath, int frames) {
+        const bool adaptive = adaptive_tuning_;
+        const JRasterParallelMode parallelMode = raster_parallel_mode_;
+        adaptive_tuning_ = false;
+        auto render_frame = [&]() -> double {
+            clearColorAndDepth(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f);
+            const auto start = std::chrono::steady_clock::now();
+            renderAllDrawableMeshes();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        //the first frame classifies the scene and warms up the caches
+        render_frame();
+        const JSceneClass sceneClass = JPipelineTuner::classify(frame_stats_);
+        const string machine = JPipelineTuner::machineKey(tbb::this_task_arena::max_concurrency());
+        JPipelineTuning tuning = getPipelineTuning();
+        const bool cached = JPipelineTuner::loadCalibration(cachePath, machine, sceneClass, tuning);
+        if(!cached) {
+            //the batch size of each parallel mode is tuned on its own, the fastest of the best frames wins
+            const JRasterParallelMode modes[] = { JRasterParallelMode::J_RASTER_TILE_BINNING, JRasterParallelMode::J_RASTER_PIXEL_LOCK,
+                JRasterParallelMode::J_RASTER_SORT_LAST };
+            int* const modeFaces[] = { &tuning.chunkFaces, &tuning.inflightFaces, &tuning.sortLastFaces };
+            for(int m = 0; m < 3; ++m) {
+                raster_parallel_mode_ = modes[m];
+                int& faces = *modeFaces[m];
+                int bestFaces = faces;
+                double bestSeconds = std::numeric_limits<double>::max();
+                for(int candidate = JPipelineTuner::MIN_BATCH_FACES; candidate <= JPipelineTuner::MAX_BATCH_FACES; candidate *= 2) {
+                    faces = candidate;
+                    setPipelineTuning(tuning);
+                    double seconds = std::numeric_limits<double>::max();
+                    for(int f = 0; f < std::max(frames, 1); ++f)
+                        seconds = std::min(seconds, render_frame());
+                    if(seconds < bestSeconds) {
+                        bestSeconds = seconds;
+                        bestFaces = candidate;
+                    }
+                }
+                faces = bestFaces;
+            }
+            raster_parallel_mode_ = parallelMode;
+            if(!JPipelineTuner::saveCalibration(cachePath, machine, sceneClass, tuning))
+                std::cerr << "JRenderer: can not write the pipeline calibration to " << cachePath << std::endl;
+        }
+        setPipelineTuning(tuning);
+        adaptive_tuning_ = adaptive;
+        return cached;
+    }
+
+    uint JRenderer::recordDrawableMesh(const size_t &idx) {
         if(idx >= drawable_meshes_.size())
             return 0;
 
-        uint numTriangles = 0;
         const auto& drawable = drawable_meshes_[idx];
         const auto& submeshes = drawable -> getDrawableSubMeshes();
 
@@ -315,7 +1043,16 @@ namespace JackalRenderer {
         shading_state_.depthTestMode = drawable -> getDepthTestMode();
         shading_state_.depthWriteMode = drawable -> getDepthWriteMode();
         shading_state_.alphaBlendingMode = drawable -> getAlphaBlendingMode();
+        //after the prepass the depth buffer already holds the nearest surface, only the samples on it are shaded
+        shading_state_.depthCompareMode = JDepthCompareMode::J_DEPTH_COMPARE_NEARER;
+        if(depth_prepassed_ && isDepthPrepassMesh(idx)) {
+            shading_state_.depthCompareMode = JDepthCompareMode::J_DEPTH_COMPARE_EQUAL;
+            shading_state_.depthWriteMode = JDepthWriteMode::J_DEPTH_WRITE_DISABLE;
+        }
 
+        //the uniforms change below, the recorded draws of a handler that can not be cloned still need the current ones
+        if(handler_draws_pending_)
+            renderFrameStream();
         shaderHandler -> setModelMatrix(drawable -> getModelMatrix());
         shaderHandler -> setLightingEnable(drawable -> getLightingMode() == JLightingMode::J_LIGHTING_ENABLE);
         shaderHandler -> setAmbientCoef(drawable -> getAmbientCoff());
@@ -324,153 +1061,323 @@ namespace JackalRenderer {
         shaderHandler -> setEmissionColor(drawable -> getEmissionCoff());
         shaderHandler -> setShininess(drawable -> getSpecularExponent());
         shaderHandler -> setTransparency(drawable -> getTransparency());
+        shaderHandler -> prepareLights();
 
-        tbb::filter_mode executeMode = shading_state_.alphaBlendingMode == JAlphaBlendingMode::J_ALPHA_DISABLE ? tbb::filter_mode::parallel : tbb::filter_mode::serial_in_order;
-
-        static int ntokens = tbb::this_task_arena::max_concurrency() * 128;
-        static FragmentCache fragment_cache;
-        static FramebufferMutex frab_framebuffer_mutex(backBuffer -> getWidth(), backBuffer -> getHeight());
+        if(frame_stream_ == nullptr)
+            frame_stream_ = std::make_shared<FrameStream>();
+        uint numTriangles = 0;
+        //the clone keeps the uniforms and the material of its draws, the handler moves on to the next ones.
+        //Submeshes with the textures of the previous one share its clone
+        JShadingPipeline::ptr shader = nullptr;
+        glm::ivec4 shaderTextures(-1);
         for(size_t s = 0; s < submeshes.size(); ++s) {
             const auto& submesh = submeshes[s];
-            int faceNum = submesh.getIndices().size() / 3;
-            numTriangles + faceNum;
+            numTriangles += submesh.getIndices().size() / 3;
 
-            shaderHandler -> setDiffuseTexId(submesh.getDiffuseMapTexId());
-            shaderHandler -> setSpecularTexId(submesh.getSpecularMapTexId());
-            shaderHandler -> setNormalTexId(submesh.getNormalMapTexId());
-            shaderHandler -> setGlowTexId(submesh.getGlowMapTexId()); //Emission
+            const glm::ivec4 textures(submesh.getDiffuseMapTexId(), submesh.getSpecularMapTexId(),
+                submesh.getNormalMapTexId(), submesh.getGlowMapTexId());
+            if(shader == nullptr || textures != shaderTextures) {
+                if(handler_draws_pending_)
+                    renderFrameStream();
+                //the material of the submesh also selects the shader permutation, see JShadingPipeline::getShaderFeatures
+                shaderHandler -> setDiffuseTexId(textures.x);
+                shaderHandler -> setSpecularTexId(textures.y);
+                shaderHandler -> setNormalTexId(textures.z);
+                shaderHandler -> setGlowTexId(textures.w); //Emission
+                shader = shaderHandler -> clone();
+                shaderTextures = textures;
+                if(shader == nullptr) {
+                    //the handler itself is recorded until it changes, see JShadingPipeline::clone
+                    if(!clone_warned_)
+                        std::cerr << "JRenderer: the shading pipeline can not be cloned, its draws are rendered one material at a time."
+                            " Derive it from JClonable" << std::endl;
+                    clone_warned_ = true;
+                    shader = shaderHandler;
+                }
+            }
 
-            DrawcallSetting drawCall(submesh.getVertices(), submesh.getIndices(), shaderHandler.get(),
+            DrawcallSetting drawCall(makeVertexStreamView(submesh), submesh.getIndices(), nullptr,
                 shading_state_, viewport_Matrix, frustumNearFar.x, frustumNearFar.y, backBuffer.get());
+            drawCall.subpixel_bits = subpixel_bits_;
+            drawCall.geometry_pass = geometry_pass_;
+            drawCall.depth_only = depth_only_pass_;
+            frame_stream_ -> addDraw(drawCall, shader);
+            handler_draws_pending_ = handler_draws_pending_ || shader == shaderHandler;
+        }
+        return numTriangles;
+    }
+
+    bool JRenderer::isDepthPrepassMesh(const size_t& idx) const {
+        const auto& drawable = drawable_meshes_[idx];
+        return drawable -> getAlphaBlendingMode() == JAlphaBlendingMode::J_ALPHA_DISABLE
+            && drawable -> getDepthTestMode() == JDepthTestMode::J_DEPTH_TEST_ENABLE
+            && drawable -> getDepthWriteMode() == JDepthWriteMode::J_DEPTH_WRITE_ENABLE;
+    }
+
+    bool JRenderer::isOrderIndependentMesh(const size_t& idx) const {
+        return drawable_meshes_[idx] -> getAlphaBlendingMode() == JAlphaBlendingMode::J_ALPHA_ORDER_INDEPENDENT;
+    }
+
+    void JRenderer::renderFrameStream() {
+        if(frame_stream_ == nullptr)
+            return;
+        //the rasterizer, the fragment stage and the framebuffer writes are specialized per sampling number
+        switch(backBuffer -> getSamplingNum()) {
+            case 1: renderFrameStream<1>(); break;
+            case 2: renderFrameStream<2>(); break;
+            case 4: renderFrameStream<4>(); break;
+            case 8: renderFrameStream<8>(); break;
+            default: break;
+        }
+        frame_stream_ -> clear();
+        handler_draws_pending_ = false;
+    }
 
-            for(int f = 0; f < faceNum; f += PIPELINE_BATCH_SIZE) {
-                int startIdx = f;
-                int endIdx = glm::min(f + PIPELINE_BATCH_SIZE, faceNum);
-                tbb::parallel_pipeline(ntokens, tbb::make_filter<void, int>(executeMode, TBBVertexRastFilter(PIPELINE_BATCH_SIZE, startIdx, endIdx, drawCall, fragment_cache)) &
-                    tbb::make_filter<int, void>(executeMode, TBBFragmentFilter(PIPELINE_BATCH_SIZE, drawCall, fragment_cache, frab_framebuffer_mutex)));
+    template<int N>
+    void JRenderer::renderFrameStream() {
+        FrameStream& stream = *frame_stream_;
+        const int faceNum = stream.getFaceNum();
+        if(faceNum == 0)
+            return;
+        const auto start = std::chrono::steady_clock::now();
+        const JPipelineTuning& tuning = getPipelineTuning();
+        StageCounters counters;
+        if(raster_parallel_mode_ == JRasterParallelMode::J_RASTER_PIXEL_LOCK && framebuffer_mutex_ == nullptr)
+            framebuffer_mutex_ = std::make_shared<FramebufferMutex>(backBuffer -> getWidth(), backBuffer -> getHeight());
+        if(tile_binner_ == nullptr)
+            tile_binner_ = std::make_shared<TileBinner>();
+        if(raster_parallel_mode_ == JRasterParallelMode::J_RASTER_SORT_LAST && sort_last_buffers_ == nullptr)
+            sort_last_buffers_ = std::make_shared<SortLastBuffers>();
+        if(raster_buffers_ == nullptr)
+            raster_buffers_ = std::make_shared<RasterBuffers>();
+        auto& fragment_cache = raster_buffers_ -> get<N>().fragment_cache;
+        auto& tile_quads = raster_buffers_ -> get<N>().tile_quads;
+
+        //post-transform cache, shared vertices are shaded once instead of once per face
+        stream.transformVertices();
+
+        //sort-middle rendering of the stream faces [beginFace, endFace): vertex and raster work stay parallel,
+        //every tile applies its fragments in primitive order, so blending needs no serialization here
+        auto render_tiles = [&](const int& beginFace, const int& endFace) {
+            const int chunkFaces = tuning.chunkFaces;
+            int numChunks = (endFace - beginFace + chunkFaces - 1) / chunkFaces;
+            tile_binner_ -> reset(backBuffer -> getWidth(), backBuffer -> getHeight(), numChunks);
+            parallelLoop(0, numChunks, [&](const int& c) {
+                tile_binner_ -> binFaces(stream, c, beginFace + c * chunkFaces, glm::min(beginFace + (c + 1) * chunkFaces, endFace));
+            });
+            parallelLoop(0, tile_binner_ -> getTileNum(), [&](const int& t) {
+                counters.local().quads += tile_binner_ -> renderTile<N>(stream, t, tile_quads.local());
+            });
+            frame_stats_.triangles += tile_binner_ -> getTriangleNum();
+        };
+
+        if(raster_parallel_mode_ == JRasterParallelMode::J_RASTER_TILE_BINNING) {
+            render_tiles(0, faceNum);
+        }else if(raster_parallel_mode_ == JRasterParallelMode::J_RASTER_SORT_LAST) {
+            //the merge keeps the nearest sample, which is only what the other modes produce for opaque draws
+            //that test and write depth, the others are binned
+            auto mergeable = [&](const int& draw) {
+                const DrawcallSetting& draw_call = stream.getDraw(draw);
+                const JShadingState& state = draw_call.shading_state;
+                return !draw_call.geometry_pass && state.alphaBlendingMode == JAlphaBlendingMode::J_ALPHA_DISABLE
+                    && state.depthTestMode == JDepthTestMode::J_DEPTH_TEST_ENABLE
+                    && state.depthWriteMode == JDepthWriteMode::J_DEPTH_WRITE_ENABLE
+                    && state.depthCompareMode == JDepthCompareMode::J_DEPTH_COMPARE_NEARER;
+            };
+            for(int first = 0, last = 0; first < stream.getDrawNum(); first = last) {
+                const bool merged = mergeable(first);
+                while(last < stream.getDrawNum() && mergeable(last) == merged)
+                    ++last;
+                const int beginFace = stream.getFirstFace(first);
+                const int endFace = stream.getFirstFace(last);
+                if(!merged) {
+                    render_tiles(beginFace, endFace);
+                    continue;
+                }
+                const int chunkFaces = tuning.sortLastFaces;
+                const int numChunks = (endFace - beginFace + chunkFaces - 1) / chunkFaces;
+                sort_last_buffers_ -> begin();
+                parallelLoop(0, numChunks, [&](const int& c) {
+                    JFrameBuffer* target = sort_last_buffers_ -> local(*backBuffer);
+                    auto& local = counters.local();
+                    local.quads += SortLastBuffers::renderFaces<N>(stream, beginFace + c * chunkFaces,
+                        glm::min(beginFace + (c + 1) * chunkFaces, endFace), target, tile_quads.local(), local.triangles);
+                });
+                //a depth prepass has no colors to merge
+                sort_last_buffers_ -> composite(*backBuffer, !stream.getDraw(first).depth_only);
+            }
+        }else {
+            //the pipeline has as many tokens as the cache has slots
+            const int inflightFaces = tuning.inflightFaces;
+            if((int)fragment_cache.size() < inflightFaces)
+                fragment_cache.resize(inflightFaces);
+            FreeSlots free_slots;
+            for(int slot = 0; slot < inflightFaces; ++slot)
+                free_slots.push(slot);
+            //the order of the fragments only matters to blending, order independent accumulation commutes
+            auto ordered = [&](const int& draw) {
+                const JAlphaBlendingMode mode = stream.getDraw(draw).shading_state.alphaBlendingMode;
+                return mode != JAlphaBlendingMode::J_ALPHA_DISABLE && mode != JAlphaBlendingMode::J_ALPHA_ORDER_INDEPENDENT;
+            };
+            //opaque runs of draws go through the locked pipeline, ordered ones are binned so that only each tile is in order
+            for(int first = 0, last = 0; first < stream.getDrawNum(); first = last) {
+                const bool inOrder = ordered(first);
+                while(last < stream.getDrawNum() && ordered(last) == inOrder)
+                    ++last;
+                if(inOrder) {
+                    render_tiles(stream.getFirstFace(first), stream.getFirstFace(last));
+                    continue;
+                }
+                atomic<int> nextFace(0);
+                tbb::parallel_pipeline(inflightFaces,
+                    tbb::make_filter<void, int>(tbb::filter_mode::parallel, TBBVertexRastFilter<N>(nextFace, stream.getFirstFace(first), stream.getFirstFace(last), stream, fragment_cache, free_slots)) &
+                    tbb::make_filter<int, void>(tbb::filter_mode::parallel, TBBFragmentFilter<N>(stream, fragment_cache, *framebuffer_mutex_, free_slots, counters)));
+                //the locked path does not maintain the hierarchical z, the binned one reads it
+                backBuffer -> invalidateHiZ();
             }
         }
-        return numTriangles;
+        for(const auto& local : counters) {
+            frame_stats_.triangles += local.triangles;
+            frame_stats_.quads += local.quads;
+        }
+        frame_stats_.faces += faceNum;
+        frame_stats_.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    template<int N>
+    void JRenderer::lightGBuffer() {
+        JFrameBuffer* framebuffer = backBuffer.get();
+        const int width = framebuffer -> getWidth();
+        const int height = framebuffer -> getHeight();
+        const int tilesX = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+        const int tilesY = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+        //every tile is lit by one worker, 2x2 quads of pixels at a time as in the fragment stage
+        parallelLoop(0, tilesX * tilesY, [&](const int& t) {
+            const glm::ivec2 tileMin((t % tilesX) * RASTER_TILE_SIZE, (t / tilesX) * RASTER_TILE_SIZE);
+            const glm::ivec2 tileMax(glm::min(tileMin.x + RASTER_TILE_SIZE, width), glm::min(tileMin.y + RASTER_TILE_SIZE, height));
+            for(int y = tileMin.y; y < tileMax.y; y += 2) {
+                for(int x = tileMin.x; x < tileMax.x; x += 2) {
+                    //the sampling points of every pixel that still wait for their surface to be lit
+                    unsigned int remaining[4] = { 0, 0, 0, 0 };
+                    for(int p = 0; p < 4; ++p) {
+                        const int px = x + (p & 1), py = y + (p >> 1);
+                        if(px >= tileMax.x || py >= tileMax.y)
+                            continue;
+                        for(int s = 0; s < N; ++s) {
+                            if(framebuffer -> readGBufferSurface(px, py, s) != 0)
+                                remaining[p] |= 1u << s;
+                        }
+                    }
+                    //one surface per pixel at a time, most pixels have only one and are lit once
+                    while(remaining[0] | remaining[1] | remaining[2] | remaining[3]) {
+                        const JGBufferTexel* texels[4] = { nullptr, nullptr, nullptr, nullptr };
+                        unsigned int coverages[4] = { 0, 0, 0, 0 };
+                        unsigned int pixelMask = 0;
+                        for(int p = 0; p < 4; ++p) {
+                            if(remaining[p] == 0)
+                                continue;
+                            const int px = x + (p & 1), py = y + (p >> 1);
+                            int first = 0;
+                            while(!(remaining[p] & (1u << first)))
+                                ++first;
+                            const unsigned char surface = framebuffer -> readGBufferSurface(px, py, first);
+                            for(int s = first; s < N; ++s) {
+                                if((remaining[p] & (1u << s)) && framebuffer -> readGBufferSurface(px, py, s) == surface)
+                                    coverages[p] |= 1u << s;
+                            }
+                            remaining[p] &= ~coverages[p];
+                            texels[p] = &framebuffer -> readGBuffer(px, py, first);
+                            pixelMask |= 1u << p;
+                        }
+                        glm::vec4 fragColors[4];
+                        shaderHandler -> lightingQuad(glm::ivec2(x, y), texels, pixelMask, fragColors);
+                        for(int p = 0; p < 4; ++p) {
+                            if(pixelMask & (1u << p))
+                                framebuffer -> writeColorWithMask<N>(x + (p & 1), y + (p >> 1), fragColors[p], JTMaskPixelSampler<N>(coverages[p]));
+                        }
+                    }
+                }
+            }
+        });
     }
 
     uchar *JRenderer::commitRenderedColorBuffer() {
         const auto& pixelBuffer = frontBuffer -> getColorBuffer();
+        const size_t samplingNum = frontBuffer -> getSamplingNum();
         parallelLoop((size_t)0, (size_t)(frontBuffer -> getWidth() * frontBuffer -> getHeight()), [&](const size_t& index) {
-            const auto& pixel = pixelBuffer[index];
-            renderedImg[index * 3 + 0] = pixel[0][0];
-            renderedImg[index * 3 + 1] = pixel[0][1];
-            renderedImg[index * 3 + 2] = pixel[0][2];
+            const auto& pixel = pixelBuffer[index * samplingNum]; //resolved into the first sampling point
+            renderedImg[index * 3 + 0] = pixel[0];
+            renderedImg[index * 3 + 1] = pixel[1];
+            renderedImg[index * 3 + 2] = pixel[2];
         });
         return renderedImg.data();
     }
 
-    vector<JShadingPipeline::VertexData> JRenderer::clipingSutherlandHodgeman(const JShadingPipeline::VertexData &v0, const JShadingPipeline::VertexData &v1, const JShadingPipeline::VertexData &v2, const float &near, const float &far) {
+    int JRenderer::clipingSutherlandHodgeman(const JShadingPipeline::VertexData &v0, const JShadingPipeline::VertexData &v1,
+        const JShadingPipeline::VertexData &v2, const float &near, const float &far, ClipPolygon &polygon) {
         //clipping using homogeneous coordinates
         //ref: https://dl.acm.org/doi/pdf/10.1145/965139.807398
-        auto isPointInsideInClipingFrustum = [](const glm::vec4& p, const float& near, const float& far) -> bool {
-            return (p.x <= p.w && p.x >= -p.w) && (p.y <= p.w && p.y >= -p.w)
-                && (p.z <= p.w && p.z >= -p.w) && (p.w <= far && p.w >= near);
-        };
-
-        if(isPointInsideInClipingFrustum(v0.cpos, near, far) &&
-            isPointInsideInClipingFrustum(v1.cpos, near, far) &&
-            isPointInsideInClipingFrustum(v2.cpos, near, far)) {
-            return {v0, v1, v2};
-        }// all vertices are inside the frustum
-
-        //all vertices are outside the frustum, faster than below
-        if (v0.cpos.w < near && v1.cpos.w < near && v2.cpos.w < near)
-            return{};
-        if (v0.cpos.w > far && v1.cpos.w > far && v2.cpos.w > far)
-            return{};
-        if (v0.cpos.x > v0.cpos.w && v1.cpos.x > v1.cpos.w && v2.cpos.x > v2.cpos.w)
-            return{};
-        if (v0.cpos.x < -v0.cpos.w && v1.cpos.x < -v1.cpos.w && v2.cpos.x < -v2.cpos.w)
-            return{};
-        if (v0.cpos.y > v0.cpos.w && v1.cpos.y > v1.cpos.w && v2.cpos.y > v2.cpos.w)
-            return{};
-        if (v0.cpos.y < -v0.cpos.w && v1.cpos.y < -v1.cpos.w && v2.cpos.y < -v2.cpos.w)
-            return{};
-        if (v0.cpos.z > v0.cpos.w && v1.cpos.z > v1.cpos.w && v2.cpos.z > v2.cpos.w)
-            return{};
-        if (v0.cpos.z < -v0.cpos.w && v1.cpos.z < -v1.cpos.w && v2.cpos.z < -v2.cpos.w)
-            return{};
-
-        // {
-        //     //as alternative
-        //     if(!isPointInsideInClipingFrustum(v0.cpos, near, far) &&
-        //         !isPointInsideInClipingFrustum(v1.cpos, near, far) &&
-        //         !isPointInsideInClipingFrustum(v2.cpos, near, far)) {
-        //         return {};
-        //     }
-        // }
-
-
-        vector<JShadingPipeline::VertexData> insideVertices;
-        vector<JShadingPipeline::VertexData> tmp = {v0, v1, v2}; //原始顶点, 迭代初始值
-        enum Axis { X = 0, Y = 1, Z = 2};
-
-        //3d clipping
-        {
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::X, +1);
-            tmp = insideVertices;
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::X, -1);
-            tmp = insideVertices;
-        }
-        {
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::Y, +1);
-            tmp = insideVertices;
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::Y, -1);
-            tmp = insideVertices;
-        }
-        {
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::Z, +1);
-            tmp = insideVertices;
-            insideVertices = clipingSutherlandHodgemanAux(tmp, Axis::Z, -1);
-            tmp = insideVertices;
-        }
+        const unsigned int c0 = computeOutcode(v0.cpos, near, far);
+        const unsigned int c1 = computeOutcode(v1.cpos, near, far);
+        const unsigned int c2 = computeOutcode(v2.cpos, near, far);
+        polygon.num = 0;
+        //all vertices are outside one plane of the frustum
+        if((c0 & c1 & c2 & CLIP_REJECT_MASK) != 0)
+            return 0;
+        polygon.vertices[0] = v0;
+        polygon.vertices[1] = v1;
+        polygon.vertices[2] = v2;
+        polygon.num = 3;
+        const unsigned int outside = c0 | c1 | c2;
+        if((outside & CLIP_REQUIRED_MASK) == 0)
+            return polygon.num;
 
-        {
-            insideVertices = {};
-            int numVerts = tmp.size();
-            constexpr float wClippingPlane = 1e-5;
-            for(int i = 0; i < numVerts; ++i) {
-                const auto& begVert = tmp[(i - 1 + numVerts) % numVerts];
-                const auto& endVert = tmp[i];
-                float begIsInside = (begVert.cpos.w < wClippingPlane) ? -1 : 1;
-                float endIsInside = (endVert.cpos.w < wClippingPlane) ? -1 : 1;
-                if(begIsInside * endIsInside < 0) {
-                    float t = (wClippingPlane - begVert.cpos.w) / (begVert.cpos.w - endVert.cpos.w);
-                    auto intersectedVert = JShadingPipeline::VertexData::lerp(begVert, endVert, t);
-                    insideVertices.push_back(intersectedVert);
-                }
-                if(endIsInside > 0) {
-                    insideVertices.push_back(endVert);
-                }
-            }
+        //ping-pong between polygon and tmp, the planes are dot(plane, cpos) + offset >= 0
+        ClipPolygon tmp;
+        ClipPolygon* src = &polygon;
+        ClipPolygon* dst = &tmp;
+        auto clip = [&](const glm::vec4& plane, const float& offset) {
+            clipingSutherlandHodgemanAux(*src, plane, offset, *dst);
+            std::swap(src, dst);
+        };
+        clip(glm::vec4(0.0f, 0.0f, -1.0f, 1.0f), 0.0f); //z <= w
+        clip(glm::vec4(0.0f, 0.0f, 1.0f, 1.0f), 0.0f); //z >= -w
+        //keeps w away from 0 for the perspective division
+        constexpr float wClippingPlane = 1e-5;
+        clip(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), -wClippingPlane);
+        //the guard band planes are only needed by triangles reaching beyond them
+        if(outside & GUARD_POS_X) clip(glm::vec4(-1.0f, 0.0f, 0.0f, GUARD_BAND), 0.0f);
+        if(outside & GUARD_NEG_X) clip(glm::vec4(1.0f, 0.0f, 0.0f, GUARD_BAND), 0.0f);
+        if(outside & GUARD_POS_Y) clip(glm::vec4(0.0f, -1.0f, 0.0f, GUARD_BAND), 0.0f);
+        if(outside & GUARD_NEG_Y) clip(glm::vec4(0.0f, 1.0f, 0.0f, GUARD_BAND), 0.0f);
+        if(src != &polygon) {
+            std::copy(tmp.vertices, tmp.vertices + tmp.num, polygon.vertices);
+            polygon.num = tmp.num;
         }
-        return insideVertices;
+        if(polygon.num < 3)
+            polygon.num = 0;
+        return polygon.num;
     }
 
-    vector<JShadingPipeline::VertexData> JRenderer::clipingSutherlandHodgemanAux(const vector<JShadingPipeline::VertexData> &polygon, const int &axis, const int &side) {
-        vector<JShadingPipeline::VertexData> insidePolygon; //空
-        int numVerts = polygon.size();
+    void JRenderer::clipingSutherlandHodgemanAux(const ClipPolygon &polygon, const glm::vec4 &plane, const float &offset,
+        ClipPolygon &insidePolygon) {
+        insidePolygon.num = 0;
+        const int numVerts = polygon.num;
         for(int i = 0; i < numVerts; ++i) {
-            const auto& begVert = polygon[(i - 1 + numVerts) % numVerts];
-            const auto& endVert = polygon[i];
-            char begIsInside = ((side * (begVert.cpos[axis]) <= begVert.cpos.w) ? 1 : -1);
-            char endIsInside = ((side * (endVert.cpos[axis]) <= endVert.cpos.w) ? 1 : -1);
-            if(begIsInside * endIsInside < 0) { //有交点
-                //TODO fomular
-                //float t = (begVert.cpos.w + side * begVert.cpos[axis]) / ((begVert.cpos.w + side * begVert.cpos[axis]) - (endVert.cpos.w + side * endVert.cpos[axis]));
-                float t = (begVert.cpos.w - side * begVert.cpos[axis]) / ((begVert.cpos.w - side * begVert.cpos[axis]) - (endVert.cpos.w - side * endVert.cpos[axis]));
-                auto intersectedVert = JShadingPipeline::VertexData::lerp(begVert, endVert, t);
-                insidePolygon.push_back(intersectedVert);
+            const auto& begVert = polygon.vertices[(i - 1 + numVerts) % numVerts];
+            const auto& endVert = polygon.vertices[i];
+            const float begDist = glm::dot(plane, begVert.cpos) + offset;
+            const float endDist = glm::dot(plane, endVert.cpos) + offset;
+            const bool begIsInside = begDist >= 0.0f;
+            const bool endIsInside = endDist >= 0.0f;
+            //a convex polygon gains at most one vertex per plane, the bound only guards against rounding
+            if(begIsInside != endIsInside && insidePolygon.num < ClipPolygon::MAX_VERTICES) { //有交点
+                const float t = begDist / (begDist - endDist);
+                insidePolygon.vertices[insidePolygon.num++] = JShadingPipeline::VertexData::lerp(begVert, endVert, t);
             }
-            if(endIsInside > 0) {
-                insidePolygon.push_back(endVert);
+            if(endIsInside && insidePolygon.num < ClipPolygon::MAX_VERTICES) {
+                insidePolygon.vertices[insidePolygon.num++] = endVert;
             }
-            return insidePolygon;
         }
     }
 }
@@ -236,6 +236,8 @@ namespace JackalRenderer {
                         drawable -> setAlphaBlendMode(JAlphaBlendingMode::J_ALPHA_BLENDING);
                     else if (blend == "alpha2coverage")
                         drawable -> setAlphaBlendMode(JAlphaBlendingMode::J_ALPHA_TO_COVERAGE);
+                    else if (blend == "oit")
+                        drawable -> setAlphaBlendMode(JAlphaBlendingMode::J_ALPHA_ORDER_INDEPENDENT);
                     else
                         drawable -> setAlphaBlendMode(JAlphaBlendingMode::J_ALPHA_DISABLE);
                 }
@@ -3,14 +3,380 @@
 //
 
 #include "JShaderProgram.h"
+#include "JQuadLanes.h"
+
+#include <cmath>
+#include <type_traits>
+#include <typeinfo>
+#include "JSIMDUtils.h"
 
 namespace JackalRenderer {
+    namespace {
+        constexpr int VERTEX_LANES = 16; //vertices transformed at once by J3DShadingPipeline::vertexShaderSIMD
+
+        //positions and normals of a vertex batch in structure of arrays layout
+        struct VertexLanes {
+            alignas(32) float px[VERTEX_LANES], py[VERTEX_LANES], pz[VERTEX_LANES]; //object space in, world space out
+            alignas(32) float nx[VERTEX_LANES], ny[VERTEX_LANES], nz[VERTEX_LANES];
+            alignas(32) float cx[VERTEX_LANES], cy[VERTEX_LANES], cz[VERTEX_LANES], cw[VERTEX_LANES]; //clip space out
+        };
+
+        struct ScalarLanes {
+            using reg = float;
+            static constexpr int width = 1;
+            static reg load(const float* p) { return *p; }
+            static void store(float* p, const reg& v) { *p = v; }
+            static reg set1(const float& v) { return v; }
+            static reg add(const reg& a, const reg& b) { return a + b; }
+            static reg mul(const reg& a, const reg& b) { return a * b; }
+            static reg rsqrt(const reg& a) { return 1.0f / std::sqrt(a); }
+        };
+#if defined(JACKAL_SIMD_SSE2)
+        struct SSELanes {
+            using reg = __m128;
+            static constexpr int width = 4;
+            static reg load(const float* p) { return _mm_load_ps(p); }
+            static void store(float* p, const reg& v) { _mm_store_ps(p, v); }
+            static reg set1(const float& v) { return _mm_set1_ps(v); }
+            static reg add(const reg& a, const reg& b) { return _mm_add_ps(a, b); }
+            static reg mul(const reg& a, const reg& b) { return _mm_mul_ps(a, b); }
+            static reg rsqrt(const reg& a) { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a)); }
+        };
+#endif
+#if defined(JACKAL_SIMD_AVX2)
+        struct AVXLanes {
+            using reg = __m256;
+            static constexpr int width = 8;
+            static reg load(const float* p) { return _mm256_load_ps(p); }
+            static void store(float* p, const reg& v) { _mm256_store_ps(p, v); }
+            static reg set1(const float& v) { return _mm256_set1_ps(v); }
+            static reg add(const reg& a, const reg& b) { return _mm256_add_ps(a, b); }
+            static reg mul(const reg& a, const reg& b) { return _mm256_mul_ps(a, b); }
+            static reg rsqrt(const reg& a) { return _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(a)); }
+        };
+#endif
+
+        //row r of m * (x, y, z, 1) in the operation order of glm's mat4 * vec4, (c0 x + c1 y) + (c2 z + c3)
+        template<typename L>
+        inline typename L::reg transformRow(const glm::mat4& m, const int& r,
+            const typename L::reg& x, const typename L::reg& y, const typename L::reg& z) {
+            return L::add(L::add(L::mul(L::set1(m[0][r]), x), L::mul(L::set1(m[1][r]), y)),
+                          L::add(L::mul(L::set1(m[2][r]), z), L::set1(m[3][r])));
+        }
+
+        //row r of m * (x, y, z) in the operation order of glm's mat3 * vec3
+        template<typename L>
+        inline typename L::reg transformRow(const glm::mat3& m, const int& r,
+            const typename L::reg& x, const typename L::reg& y, const typename L::reg& z) {
+            return L::add(L::add(L::mul(L::set1(m[0][r]), x), L::mul(L::set1(m[1][r]), y)), L::mul(L::set1(m[2][r]), z));
+        }
+
+        /**
+         * @brief the transform of J3DShadingPipeline::vertexShader on lanes [begin, end), L::width lanes at a time.
+         * Every variant evaluates the same operations in the same order, so they agree bit for bit
+         * @return the first lane that is left because fewer than L::width lanes remain
+         */
+        template<typename L>
+        inline int transformVertexLanes(const glm::mat4& model, const glm::mat3& normalMatrix, const glm::mat4& viewProject,
+            VertexLanes& v, int begin, const int& end) {
+            for(; begin + L::width <= end; begin += L::width) {
+                const typename L::reg x = L::load(v.px + begin), y = L::load(v.py + begin), z = L::load(v.pz + begin);
+                const typename L::reg wx = transformRow<L>(model, 0, x, y, z);
+                const typename L::reg wy = transformRow<L>(model, 1, x, y, z);
+                const typename L::reg wz = transformRow<L>(model, 2, x, y, z);
+                L::store(v.px + begin, wx);
+                L::store(v.py + begin, wy);
+                L::store(v.pz + begin, wz);
+                L::store(v.cx + begin, transformRow<L>(viewProject, 0, wx, wy, wz));
+                L::store(v.cy + begin, transformRow<L>(viewProject, 1, wx, wy, wz));
+                L::store(v.cz + begin, transformRow<L>(viewProject, 2, wx, wy, wz));
+                L::store(v.cw + begin, transformRow<L>(viewProject, 3, wx, wy, wz));
+
+                const typename L::reg nx = L::load(v.nx + begin), ny = L::load(v.ny + begin), nz = L::load(v.nz + begin);
+                const typename L::reg tx = transformRow<L>(normalMatrix, 0, nx, ny, nz);
+                const typename L::reg ty = transformRow<L>(normalMatrix, 1, nx, ny, nz);
+                const typename L::reg tz = transformRow<L>(normalMatrix, 2, nx, ny, nz);
+                //glm::normalize: v * inversesqrt(dot(v, v))
+                const typename L::reg s = L::rsqrt(L::add(L::add(L::mul(tx, tx), L::mul(ty, ty)), L::mul(tz, tz)));
+                L::store(v.nx + begin, L::mul(tx, s));
+                L::store(v.ny + begin, L::mul(ty, s));
+                L::store(v.nz + begin, L::mul(tz, s));
+            }
+            return begin;
+        }
+
+        //per fragment inputs of the lighting pipelines, helper lanes repeat the first active fragment
+        struct QuadSurface {
+            glm::vec3 fragPos[4];
+            glm::vec4 diffTexColor[4];
+            QuadVec3 pos;
+            QuadVec3 nor; //not normalized, perturbed by the normal map if there is one
+            QuadVec3 diffuse; //also the ambient color
+            QuadVec3 specular;
+            QuadVec3 emission;
+        };
+
+        /**
+         * @brief samples the material textures of the active fragments, the LOD of every texture is computed once per quad
+         * @tparam Features JShaderFeature bits of the material, textures it has no bit for are not sampled
+         */
+        template<unsigned int Features>
+        inline void fetchQuadSurface(const JShadingPipeline::QuadFragments& quad, const unsigned int& activeMask,
+            const int& diffuseTexId, const int& specularTexId, const int& glowTexId, const int& normalTexId,
+            const glm::vec3& kD, const glm::vec3& kS, const glm::vec3& kE, QuadSurface& surface) {
+            constexpr bool hasDiffuseTex = (Features & JShadingPipeline::J_SHADER_DIFFUSE_TEX) != 0;
+            constexpr bool hasSpecularTex = (Features & JShadingPipeline::J_SHADER_SPECULAR_TEX) != 0;
+            constexpr bool hasGlowTex = (Features & JShadingPipeline::J_SHADER_GLOW_TEX) != 0;
+            constexpr bool hasNormalTex = (Features & JShadingPipeline::J_SHADER_NORMAL_TEX) != 0;
+            const float diffuseLod = hasDiffuseTex ? JShadingPipeline::textureLod(diffuseTexId, quad.dUVdx, quad.dUVdy) : 0.0f;
+            const float specularLod = hasSpecularTex ? JShadingPipeline::textureLod(specularTexId, quad.dUVdx, quad.dUVdy) : 0.0f;
+            const float glowLod = hasGlowTex ? JShadingPipeline::textureLod(glowTexId, quad.dUVdx, quad.dUVdy) : 0.0f;
+            const float normalLod = hasNormalTex ? JShadingPipeline::textureLod(normalTexId, quad.dUVdx, quad.dUVdy) : 0.0f;
+            glm::vec3 nor[4], diffuse[4], specular[4], emission[4];
+            int first = -1;
+            for(int p = 0; p < 4; ++p) {
+                if(!(activeMask & (1u << p)))
+                    continue;
+                const auto& data = quad.fragments[p];
+                if(first == -1)
+                    first = p;
+                surface.fragPos[p] = data.pos;
+                surface.diffTexColor[p] = hasDiffuseTex ? JShadingPipeline::texture2DLod(diffuseTexId, data.tex, diffuseLod) : glm::vec4(1.0f);
+                diffuse[p] = hasDiffuseTex ? glm::vec3(surface.diffTexColor[p]) : kD;
+                specular[p] = hasSpecularTex ? glm::vec3(JShadingPipeline::texture2DLod(specularTexId, data.tex, specularLod)) : kS;
+                emission[p] = hasGlowTex ? glm::vec3(JShadingPipeline::texture2DLod(glowTexId, data.tex, glowLod)) : kE;
+                nor[p] = hasNormalTex
+                    ? data.tbn * (glm::vec3(JShadingPipeline::texture2DLod(normalTexId, data.tex, normalLod)) * 2.0f - glm::vec3(1.0f))
+                    : data.nor;
+            }
+            for(int p = 0; p < 4; ++p) {
+                if(activeMask & (1u << p))
+                    continue;
+                surface.fragPos[p] = surface.fragPos[first];
+                surface.diffTexColor[p] = surface.diffTexColor[first];
+                nor[p] = nor[first];
+                diffuse[p] = diffuse[first];
+                specular[p] = specular[first];
+                emission[p] = emission[first];
+            }
+            surface.pos = QuadVec3(surface.fragPos);
+            surface.nor = QuadVec3(nor);
+            surface.diffuse = QuadVec3(diffuse);
+            surface.specular = QuadVec3(specular);
+            surface.emission = QuadVec3(emission);
+        }
+
+        //fragColors[p] = (emission, alpha) of the active fragments, the output without lighting
+        inline void storeQuadEmission(const QuadSurface& surface, const float alpha[4], const unsigned int& activeMask, glm::vec4 fragColors[4]) {
+            float r[4], g[4], b[4];
+            surface.emission.x.store(r);
+            surface.emission.y.store(g);
+            surface.emission.z.store(b);
+            for(int p = 0; p < 4; ++p) {
+                if(activeMask & (1u << p))
+                    fragColors[p] = glm::vec4(r[p], g[p], b[p], alpha[p]);
+            }
+        }
+
+        //fragColors[p] = (color + emission, alpha) of the active fragments, tone mapped with J_SHADER_TONE_MAPPING
+        template<unsigned int Features>
+        inline void storeQuadColors(const QuadVec3& color, const QuadVec3& emission, const float alpha[4], const float& exposure,
+            const unsigned int& activeMask, glm::vec4 fragColors[4]) {
+            float r[4], g[4], b[4];
+            (color.x + emission.x).store(r);
+            (color.y + emission.y).store(g);
+            (color.z + emission.z).store(b);
+            for(int p = 0; p < 4; ++p) {
+                if(!(activeMask & (1u << p)))
+                    continue;
+                fragColors[p] = glm::vec4(r[p], g[p], b[p], alpha[p]);
+                if(Features & JShadingPipeline::J_SHADER_TONE_MAPPING) {
+                    glm::vec3 hdrColor(fragColors[p]);
+                    fragColors[p] = glm::vec4(glm::vec3(1.0f - glm::exp(-hdrColor * exposure)), fragColors[p].a);
+                }
+            }
+        }
+
+        //tone mapping is only ever enabled in HDR builds, the others need no permutations for it
+#ifdef HDR
+        constexpr unsigned int LIGHTING_SHADER_FEATURES = ~0u;
+#else
+        constexpr unsigned int LIGHTING_SHADER_FEATURES = ~0u & ~JShadingPipeline::J_SHADER_TONE_MAPPING;
+#endif
+        //features read by the Phong and Blinn-Phong pipelines, they do not sample normal maps
+        constexpr unsigned int PHONG_SHADER_FEATURES = LIGHTING_SHADER_FEATURES & ~JShadingPipeline::J_SHADER_NORMAL_TEX;
+        //the G-buffer holds the surface before tone mapping, which is part of the lighting pass
+        constexpr unsigned int SURFACE_SHADER_FEATURES = ~JShadingPipeline::J_SHADER_TONE_MAPPING;
+
+        inline void storeLanes(const QuadVec3& v, glm::vec3 out[4]) {
+            float x[4], y[4], z[4];
+            v.x.store(x);
+            v.y.store(y);
+            v.z.store(z);
+            for(int p = 0; p < 4; ++p)
+                out[p] = glm::vec3(x[p], y[p], z[p]);
+        }
+
+        /**
+         * @brief G-buffer texels of the active fragments, the inputs of the Blinn-Phong model of lightQuadTexels
+         * @param ambientCoef kA, 1 for pipelines without an ambient coefficient
+         * @param alpha the output alpha of the fragments, lit or not
+         */
+        inline void storeQuadTexels(const QuadSurface& surface, const glm::vec3& ambientCoef, const glm::vec3& diffuseCoef,
+            const float& shininess, const float alpha[4], const bool& lit, const unsigned int& activeMask, JGBufferTexel texels[4]) {
+            glm::vec3 nor[4], diffuse[4], specular[4], emission[4];
+            storeLanes(normalize(surface.nor), nor);
+            storeLanes(surface.diffuse, diffuse);
+            storeLanes(surface.specular, specular);
+            storeLanes(surface.emission, emission);
+            for(int p = 0; p < 4; ++p) {
+                if(!(activeMask & (1u << p)))
+                    continue;
+                JGBufferTexel& texel = texels[p];
+                texel.position = surface.fragPos[p];
+                texel.normal = nor[p];
+                texel.albedo = diffuse[p];
+                texel.ambientCoef = ambientCoef;
+                texel.diffuseCoef = diffuseCoef;
+                texel.specular = specular[p];
+                texel.emission = emission[p];
+                texel.shininess = shininess;
+                texel.alpha = alpha[p];
+                texel.lit = lit;
+            }
+        }
+
+        /**
+         * @brief the lighting pass of the Blinn-Phong pipelines, the texels of a quad as lanes in the operation order
+         * of their fragment shaders, so that a deferred pixel gets the color of its forward shaded fragment
+         */
+        inline void lightQuadTexels(const JLightTable& lightTable, const glm::vec3& viewerPos, const float& exposure,
+            const glm::ivec2& quadPos, const JGBufferTexel* const texels[4], const unsigned int& activeMask, glm::vec4 fragColors[4]) {
+            glm::vec3 fragPos[4], nor[4], albedo[4], ambientCoef[4], diffuseCoef[4], specular[4], emission[4];
+            float shininess[4], alpha[4];
+            unsigned int litMask = 0;
+            int first = -1;
+            for(int p = 0; p < 4; ++p) {
+                if(!(activeMask & (1u << p)))
+                    continue;
+                const JGBufferTexel& texel = *texels[p];
+                if(first == -1)
+                    first = p;
+                fragPos[p] = texel.position;
+                nor[p] = texel.normal;
+                albedo[p] = texel.albedo;
+                ambientCoef[p] = texel.ambientCoef;
+                diffuseCoef[p] = texel.diffuseCoef;
+                specular[p] = texel.specular;
+                emission[p] = texel.emission;
+                shininess[p] = texel.shininess;
+                alpha[p] = texel.alpha;
+                if(texel.lit)
+                    litMask |= 1u << p;
+                else
+                    fragColors[p] = glm::vec4(emission[p], alpha[p]);
+            }
+            if(litMask == 0)
+                return;
+            for(int p = 0; p < 4; ++p) {
+                if(activeMask & (1u << p))
+                    continue;
+                fragPos[p] = fragPos[first];
+                nor[p] = nor[first];
+                albedo[p] = albedo[first];
+                ambientCoef[p] = ambientCoef[first];
+                diffuseCoef[p] = diffuseCoef[first];
+                specular[p] = specular[first];
+                emission[p] = emission[first];
+                shininess[p] = shininess[first];
+            }
+
+            const QuadVec3 pos(fragPos), normal(nor), diffuseColor(albedo), kA(ambientCoef), kD(diffuseCoef), specularColor(specular);
+            const QuadFloat exponent(shininess[0], shininess[1], shininess[2], shininess[3]);
+            const QuadVec3 viewDir = normalize(QuadVec3(viewerPos) - pos);
+            QuadVec3 color(glm::vec3(0.0f));
+            JShadingPipeline::forEachQuadLight(quadPos, activeMask, fragPos, pos, [&](const size_t& i, const QuadVec3& lightDir,
+                const QuadFloat& attenuation, const QuadFloat& cutoff) {
+                const QuadVec3 intensity(lightTable.intensity[i]);
+                //intensity * kA and intensity * kD are the per draw products of JShadingPipeline::prepareLights
+                QuadVec3 ambient = intensity * kA * diffuseColor;
+                QuadFloat diffCof = lanesMax(dot(normal, lightDir), 0.0f);
+                QuadVec3 diffuse = intensity * kD * diffCof * diffuseColor;
+                QuadVec3 halfWay = normalize(viewDir + lightDir);
+                QuadFloat specCof = lanesPow(lanesMax(dot(halfWay, normal), 0.0f), exponent);
+                QuadVec3 specularTerm = intensity * specCof * specularColor;
+                color = color + (ambient + diffuse + specularTerm) * attenuation * cutoff;
+            });
+            storeQuadColors<LIGHTING_SHADER_FEATURES & JShadingPipeline::J_SHADER_TONE_MAPPING>(color, QuadVec3(emission), alpha,
+                exposure, litMask, fragColors);
+        }
+
+        /**
+         * @brief the permutations Pipeline::fragmentShaderPermutation<Features & Relevant> of all shader features, built once
+         * @tparam Relevant the JShaderFeature bits the pipeline reads, the others share a permutation
+         * @tparam Output glm::vec4 for the fragment colors, JGBufferTexel for the G-buffer overloads
+         */
+        template<typename Pipeline, unsigned int Relevant, typename Output = glm::vec4>
+        class QuadShaderPermutations {
+        public:
+            using Shader = void (Pipeline::*)(const JShadingPipeline::QuadFragments&, const unsigned int&, Output*) const;
+
+            QuadShaderPermutations() { fill(std::integral_constant<unsigned int, JShadingPipeline::SHADER_PERMUTATIONS - 1>()); }
+            const Shader& operator[](const unsigned int& features) const { return shaders[features]; }
+
+        private:
+            template<unsigned int Features>
+            void fill(std::integral_constant<unsigned int, Features>) {
+                shaders[Features] = &Pipeline::template fragmentShaderPermutation<Features & Relevant>;
+                fill(std::integral_constant<unsigned int, Features - 1>());
+            }
+            void fill(std::integral_constant<unsigned int, 0>) { shaders[0] = &Pipeline::template fragmentShaderPermutation<0>; }
+
+            Shader shaders[JShadingPipeline::SHADER_PERMUTATIONS];
+        };
+
+    }
+
     void J3DShadingPipeline::vertexShader(VertexData &vertex) const {
         vertex.pos = glm::vec3(modelMatrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f));
         vertex.nor = glm::normalize(inveTransModelMatrix * vertex.nor);
         vertex.cpos = viewProjectMatrix * glm::vec4(vertex.pos, 1.0f);
     }
 
+    void J3DShadingPipeline::vertexShaderBatch(const VertexStreamView &vertices, VertexData *out) const {
+        //a subclass may override vertexShader, the SIMD transform would skip it
+        if(typeid(*this) == typeid(J3DShadingPipeline))
+            vertexShaderSIMD(vertices, out);
+        else
+            JShadingPipeline::vertexShaderBatch(vertices, out);
+    }
+
+    void J3DShadingPipeline::vertexShaderSIMD(const VertexStreamView &vertices, VertexData *out) const {
+        VertexLanes lanes;
+        for(size_t first = 0; first < vertices.count; first += VERTEX_LANES) {
+            const int num = static_cast<int>(std::min<size_t>(VERTEX_LANES, vertices.count - first));
+            VertexData* batch = out + first;
+            for(int i = 0; i < num; ++i) {
+                vertices.fetch(first + i, batch[i]);
+                lanes.px[i] = batch[i].pos.x; lanes.py[i] = batch[i].pos.y; lanes.pz[i] = batch[i].pos.z;
+                lanes.nx[i] = batch[i].nor.x; lanes.ny[i] = batch[i].nor.y; lanes.nz[i] = batch[i].nor.z;
+            }
+            int lane = 0;
+#if defined(JACKAL_SIMD_AVX2)
+            lane = transformVertexLanes<AVXLanes>(modelMatrix, inveTransModelMatrix, viewProjectMatrix, lanes, lane, num);
+#endif
+#if defined(JACKAL_SIMD_SSE2)
+            lane = transformVertexLanes<SSELanes>(modelMatrix, inveTransModelMatrix, viewProjectMatrix, lanes, lane, num);
+#endif
+            transformVertexLanes<ScalarLanes>(modelMatrix, inveTransModelMatrix, viewProjectMatrix, lanes, lane, num);
+            for(int i = 0; i < num; ++i) {
+                batch[i].pos = glm::vec3(lanes.px[i], lanes.py[i], lanes.pz[i]);
+                batch[i].nor = glm::vec3(lanes.nx[i], lanes.ny[i], lanes.nz[i]);
+                batch[i].cpos = glm::vec4(lanes.cx[i], lanes.cy[i], lanes.cz[i], lanes.cw[i]);
+            }
+        }
+    }
+
     void J3DShadingPipeline::fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const {
         fragColor = glm::vec4(data.tex, 0.0f, 1.0f);
     }
@@ -105,6 +471,44 @@ namespace JackalRenderer {
 #endif
     }
 
+    void JPhongShadingPipeling::fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        static const QuadShaderPermutations<JPhongShadingPipeling, PHONG_SHADER_FEATURES> permutations;
+        (this ->* permutations[shaderFeatures])(quad, activeMask, fragColors);
+    }
+
+    template<unsigned int Features>
+    void JPhongShadingPipeling::fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        QuadSurface surface;
+        fetchQuadSurface<Features>(quad, activeMask, diffuseTexId, specularTexId, glowTexId, -1, kD, kS, kE, surface);
+        float alpha[4];
+        if(!(Features & J_SHADER_LIGHTING)) {
+            for(int p = 0; p < 4; ++p)
+                alpha[p] = 1.0f;
+            storeQuadEmission(surface, alpha, activeMask, fragColors);
+            return;
+        }
+
+        //fragmentShader with the four fragments as lanes, in the same operation order
+        const QuadVec3 normal = surface.nor;
+        const QuadVec3 viewDir = normalize(QuadVec3(viewerPos) - surface.pos);
+        QuadVec3 color(glm::vec3(0.0f));
+        const LightProducts& products = *lightProducts;
+        forEachQuadLight(quad, surface.fragPos, surface.pos, [&](const size_t& i, const QuadVec3& lightDir,
+            const QuadFloat& attenuation, const QuadFloat& cutoff) {
+            const QuadVec3 intensity(lightTable.intensity[i]);
+            QuadVec3 ambient = intensity * surface.diffuse;
+            QuadFloat diffCof = lanesMax(dot(normal, lightDir), 0.0f);
+            QuadVec3 diffuse = QuadVec3(products.diffuse[i]) * surface.diffuse * diffCof;
+            QuadVec3 reflectDir = reflect(-lightDir, normal);
+            QuadFloat specCof = lanesPow(lanesMax(dot(viewDir, reflectDir), 0.0f), shininess);
+            QuadVec3 specular = intensity * specCof * surface.specular;
+            color = color + (ambient + diffuse + specular) * attenuation * cutoff;
+        });
+        for(int p = 0; p < 4; ++p)
+            alpha[p] = surface.diffTexColor[p].a * transparency;
+        storeQuadColors<Features>(color, surface.emission, alpha, exposure, activeMask, fragColors);
+    }
+
     void JBlinnPhongShadingPipeline::fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const {
         fragColor = glm::vec4(0.0f);
         glm::vec3 Ambient, Diffuse, Specular, Emission;
@@ -149,6 +553,65 @@ namespace JackalRenderer {
 #endif
     }
 
+    void JBlinnPhongShadingPipeline::fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        static const QuadShaderPermutations<JBlinnPhongShadingPipeline, PHONG_SHADER_FEATURES> permutations;
+        (this ->* permutations[shaderFeatures])(quad, activeMask, fragColors);
+    }
+
+    template<unsigned int Features>
+    void JBlinnPhongShadingPipeline::fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        QuadSurface surface;
+        fetchQuadSurface<Features>(quad, activeMask, diffuseTexId, specularTexId, glowTexId, -1, kD, kS, kE, surface);
+        float alpha[4];
+        if(!(Features & J_SHADER_LIGHTING)) {
+            for(int p = 0; p < 4; ++p)
+                alpha[p] = surface.diffTexColor[p].a;
+            storeQuadEmission(surface, alpha, activeMask, fragColors);
+            return;
+        }
+
+        //Blinn-Phong 光照模型, the lanes of fragmentShader
+        const QuadVec3 normal = normalize(surface.nor);
+        const QuadVec3 viewDir = normalize(QuadVec3(viewerPos) - surface.pos);
+        QuadVec3 color(glm::vec3(0.0f));
+        const LightProducts& products = *lightProducts;
+        forEachQuadLight(quad, surface.fragPos, surface.pos, [&](const size_t& i, const QuadVec3& lightDir,
+            const QuadFloat& attenuation, const QuadFloat& cutoff) {
+            const QuadVec3 intensity(lightTable.intensity[i]);
+            QuadVec3 ambient = QuadVec3(products.ambient[i]) * surface.diffuse;
+            QuadFloat diffCof = lanesMax(dot(normal, lightDir), 0.0f);
+            QuadVec3 diffuse = QuadVec3(products.diffuse[i]) * diffCof * surface.diffuse;
+            QuadVec3 halfWay = normalize(viewDir + lightDir);
+            QuadFloat specCof = lanesPow(lanesMax(dot(halfWay, normal), 0.0f), shininess);
+            QuadVec3 specular = intensity * specCof * surface.specular;
+            color = color + (ambient + diffuse + specular) * attenuation * cutoff;
+        });
+        for(int p = 0; p < 4; ++p)
+            alpha[p] = surface.diffTexColor[p].a * transparency;
+        storeQuadColors<Features>(color, surface.emission, alpha, exposure, activeMask, fragColors);
+    }
+
+    void JBlinnPhongShadingPipeline::fragmentSurfaceQuad(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const {
+        static const QuadShaderPermutations<JBlinnPhongShadingPipeline, PHONG_SHADER_FEATURES & SURFACE_SHADER_FEATURES, JGBufferTexel> permutations;
+        (this ->* permutations[shaderFeatures])(quad, activeMask, texels);
+    }
+
+    template<unsigned int Features>
+    void JBlinnPhongShadingPipeline::fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const {
+        QuadSurface surface;
+        fetchQuadSurface<Features>(quad, activeMask, diffuseTexId, specularTexId, glowTexId, -1, kD, kS, kE, surface);
+        constexpr bool lit = (Features & J_SHADER_LIGHTING) != 0;
+        float alpha[4];
+        for(int p = 0; p < 4; ++p)
+            alpha[p] = lit ? surface.diffTexColor[p].a * transparency : surface.diffTexColor[p].a;
+        storeQuadTexels(surface, kA, kD, shininess, alpha, lit, activeMask, texels);
+    }
+
+    void JBlinnPhongShadingPipeline::lightingQuad(const glm::ivec2 &quadPos, const JGBufferTexel* const texels[4], const unsigned int &activeMask,
+        glm::vec4 fragColors[4]) const {
+        lightQuadTexels(lightTable, viewerPos, exposure, quadPos, texels, activeMask, fragColors);
+    }
+
     void JBlinnPhongNormalMapShadingPipeline::vertexShader(VertexData& vertex) const {
         vertex.pos = glm::vec3(modelMatrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f));
         vertex.nor = glm::normalize(inveTransModelMatrix * vertex.nor);
@@ -210,6 +673,66 @@ namespace JackalRenderer {
 #endif
     }
 
+    void JBlinnPhongNormalMapShadingPipeline::fragmentShaderQuad(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        static const QuadShaderPermutations<JBlinnPhongNormalMapShadingPipeline, LIGHTING_SHADER_FEATURES> permutations;
+        (this ->* permutations[shaderFeatures])(quad, activeMask, fragColors);
+    }
+
+    template<unsigned int Features>
+    void JBlinnPhongNormalMapShadingPipeline::fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, glm::vec4 fragColors[4]) const {
+        QuadSurface surface;
+        fetchQuadSurface<Features>(quad, activeMask, diffuseTexId, specularTexId, glowTexId, normalTexId, kD, kS, kE, surface);
+        float alpha[4];
+        if(!(Features & J_SHADER_LIGHTING)) {
+            for(int p = 0; p < 4; ++p)
+                alpha[p] = 1.0f;
+            storeQuadEmission(surface, alpha, activeMask, fragColors);
+            return;
+        }
+
+        //the Blinn-Phong model of fragmentShader, with the normal from the normal map
+        const QuadVec3 normal = normalize(surface.nor);
+        const QuadVec3 viewDir = normalize(QuadVec3(viewerPos) - surface.pos);
+        QuadVec3 color(glm::vec3(0.0f));
+        const LightProducts& products = *lightProducts;
+        forEachQuadLight(quad, surface.fragPos, surface.pos, [&](const size_t& i, const QuadVec3& lightDir,
+            const QuadFloat& attenuation, const QuadFloat& cutoff) {
+            const QuadVec3 intensity(lightTable.intensity[i]);
+            QuadVec3 ambient = intensity * surface.diffuse;
+            QuadFloat diffCof = lanesMax(dot(normal, lightDir), 0.0f);
+            QuadVec3 diffuse = QuadVec3(products.diffuse[i]) * diffCof * surface.diffuse;
+            QuadVec3 halfWay = normalize(viewDir + lightDir);
+            QuadFloat specCof = lanesPow(lanesMax(dot(halfWay, normal), 0.0f), shininess);
+            QuadVec3 specular = intensity * specCof * surface.specular;
+            color = color + (ambient + diffuse + specular) * attenuation * cutoff;
+        });
+        for(int p = 0; p < 4; ++p)
+            alpha[p] = surface.diffTexColor[p].a * transparency;
+        storeQuadColors<Features>(color, surface.emission, alpha, exposure, activeMask, fragColors);
+    }
+
+    void JBlinnPhongNormalMapShadingPipeline::fragmentSurfaceQuad(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const {
+        static const QuadShaderPermutations<JBlinnPhongNormalMapShadingPipeline, LIGHTING_SHADER_FEATURES & SURFACE_SHADER_FEATURES, JGBufferTexel> permutations;
+        (this ->* permutations[shaderFeatures])(quad, activeMask, texels);
+    }
+
+    template<unsigned int Features>
+    void JBlinnPhongNormalMapShadingPipeline::fragmentShaderPermutation(const QuadFragments &quad, const unsigned int &activeMask, JGBufferTexel texels[4]) const {
+        QuadSurface surface;
+        fetchQuadSurface<Features>(quad, activeMask, diffuseTexId, specularTexId, glowTexId, normalTexId, kD, kS, kE, surface);
+        constexpr bool lit = (Features & J_SHADER_LIGHTING) != 0;
+        float alpha[4];
+        for(int p = 0; p < 4; ++p)
+            alpha[p] = lit ? surface.diffTexColor[p].a * transparency : 1.0f;
+        //the ambient term of this pipeline is not scaled by kA
+        storeQuadTexels(surface, glm::vec3(1.0f), kD, shininess, alpha, lit, activeMask, texels);
+    }
+
+    void JBlinnPhongNormalMapShadingPipeline::lightingQuad(const glm::ivec2 &quadPos, const JGBufferTexel* const texels[4], const unsigned int &activeMask,
+        glm::vec4 fragColors[4]) const {
+        lightQuadTexels(lightTable, viewerPos, exposure, quadPos, texels, activeMask, fragColors);
+    }
+
     void JAlphaBlendingShadingPipeline::fragmentShader(const FragmentData &data, glm::vec4 &fragColor, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const {
         fragColor = glm::vec4(kE, 1.0f);
         if(diffuseTexId != -1)
@@ -3,11 +3,134 @@
 //
 #include "JShadingPipeline.h"
 
+#include <cmath>
 #include <glm/gtc/constants.hpp>
 
 #include "JParallelWrapper.h"
+#include "JFrameBuffer.h"
+#include "JSIMDUtils.h"
 
 namespace JackalRenderer {
+    namespace {
+        constexpr int SUBPIXEL_ONE = 1 << JShadingPipeline::SUBPIXEL_BITS;
+
+        template<int N>
+        struct QuadSampleLanes {
+            static constexpr int QUAD_LANES = JShadingPipeline::QuadRecord<N>::QUAD_SAMPLES;
+            //fixed point offsets of the sampling points from the top-left pixel center of the quad,
+            //stored as doubles so that the kernels below work on exact integers
+            alignas(32) double offsetX[QUAD_LANES];
+            alignas(32) double offsetY[QUAD_LANES];
+            QuadSampleLanes() {
+                const auto& offsets = JTMaskPixelSampler<N>::getSamplingOffsets();
+                for(int lane = 0; lane < QUAD_LANES; ++lane) {
+                    const int p = lane / N, s = lane % N;
+                    //sampling offsets are multiples of 1/16 pixel, exact on the fixed point grid
+                    offsetX[lane] = (p & 1) * SUBPIXEL_ONE + std::floor(offsets[s].x * SUBPIXEL_ONE + 0.5f);
+                    offsetY[lane] = (p >> 1) * SUBPIXEL_ONE + std::floor(offsets[s].y * SUBPIXEL_ONE + 0.5f);
+                }
+            }
+        };
+        template<int N>
+        inline const QuadSampleLanes<N>& getQuadLanes() {
+            static const QuadSampleLanes<N> lanes;
+            return lanes;
+        }
+
+        template<typename T>
+        inline void buildAttributePlane(const T& a0, const T& a1, const T& a2, const glm::vec3& wdx, const glm::vec3& wdy,
+            JShadingPipeline::AttributePlane<T>& plane) {
+            plane.value = a0;
+            plane.ddx = a0 * wdx.x + a1 * wdx.y + a2 * wdx.z;
+            plane.ddy = a0 * wdy.x + a1 * wdy.y + a2 * wdy.z;
+        }
+
+        struct QuadEdgeSetup {
+            double C[3]; //edge functions 01, 12, 20 at the top-left pixel center of the quad
+            double I[3], J[3]; //x and y steps of the edge functions per fixed point unit
+            double bias[3]; //top-left fill rule, 0 for top-left edges, 1 otherwise
+            double rhw[3]; //rhw of vertex 0, 1, 2
+            double one_div_delta;
+        };
+
+        /**
+         * @brief evaluates the three edge functions at every sampling point of a 2x2 quad,
+         * 4 lanes per step with AVX2, 2 with SSE2, scalar otherwise. Edge values are integers below 2^53
+         * so the double arithmetic is exact and every variant gives the same coverage.
+         * @tparam N sampling points per pixel, a quad has 4 * N lanes
+         * @tparam TestCoverage false for quads known to be fully covered, only depth is evaluated then
+         * @return coverage bit per lane, depth receives the interpolated rhw of every covered lane
+         */
+        template<int N, bool TestCoverage>
+        inline unsigned int evaluateQuadEdges(const QuadEdgeSetup& e, const QuadSampleLanes<N>& quadLanes, float* depth) {
+            constexpr int QUAD_LANES = QuadSampleLanes<N>::QUAD_LANES;
+            unsigned int mask = TestCoverage ? 0u : (~0u >> (32 - QUAD_LANES));
+            int lane = 0;
+#if defined(JACKAL_SIMD_AVX2)
+            {
+                const __m256d zero = _mm256_setzero_pd();
+                const __m256d odd = _mm256_set1_pd(e.one_div_delta);
+                for(; lane + 4 <= QUAD_LANES; lane += 4) {
+                    const __m256d ox = _mm256_load_pd(quadLanes.offsetX + lane);
+                    const __m256d oy = _mm256_load_pd(quadLanes.offsetY + lane);
+                    __m256d E[3];
+                    __m256d inside = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+                    for(int k = 0; k < 3; ++k) {
+                        E[k] = _mm256_add_pd(_mm256_add_pd(_mm256_set1_pd(e.C[k]), _mm256_mul_pd(ox, _mm256_set1_pd(e.I[k]))),
+                            _mm256_mul_pd(oy, _mm256_set1_pd(e.J[k])));
+                        if(TestCoverage)
+                            inside = _mm256_and_pd(inside, _mm256_cmp_pd(_mm256_add_pd(E[k], _mm256_set1_pd(e.bias[k])), zero, _CMP_LE_OQ));
+                    }
+                    const __m256d d = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(
+                        _mm256_mul_pd(E[1], _mm256_set1_pd(e.rhw[0])),
+                        _mm256_mul_pd(E[2], _mm256_set1_pd(e.rhw[1]))),
+                        _mm256_mul_pd(E[0], _mm256_set1_pd(e.rhw[2]))), odd);
+                    _mm_storeu_ps(depth + lane, _mm256_cvtpd_ps(d));
+                    if(TestCoverage)
+                        mask |= (unsigned int)_mm256_movemask_pd(inside) << lane;
+                }
+            }
+#endif
+#if defined(JACKAL_SIMD_SSE2)
+            {
+                const __m128d zero = _mm_setzero_pd();
+                const __m128d odd = _mm_set1_pd(e.one_div_delta);
+                for(; lane + 2 <= QUAD_LANES; lane += 2) {
+                    const __m128d ox = _mm_load_pd(quadLanes.offsetX + lane);
+                    const __m128d oy = _mm_load_pd(quadLanes.offsetY + lane);
+                    __m128d E[3];
+                    __m128d inside = _mm_castsi128_pd(_mm_set1_epi32(-1));
+                    for(int k = 0; k < 3; ++k) {
+                        E[k] = _mm_add_pd(_mm_add_pd(_mm_set1_pd(e.C[k]), _mm_mul_pd(ox, _mm_set1_pd(e.I[k]))),
+                            _mm_mul_pd(oy, _mm_set1_pd(e.J[k])));
+                        if(TestCoverage)
+                            inside = _mm_and_pd(inside, _mm_cmple_pd(_mm_add_pd(E[k], _mm_set1_pd(e.bias[k])), zero));
+                    }
+                    const __m128d d = _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+                        _mm_mul_pd(E[1], _mm_set1_pd(e.rhw[0])),
+                        _mm_mul_pd(E[2], _mm_set1_pd(e.rhw[1]))),
+                        _mm_mul_pd(E[0], _mm_set1_pd(e.rhw[2]))), odd);
+                    _mm_storel_pi(reinterpret_cast<__m64*>(depth + lane), _mm_cvtpd_ps(d));
+                    if(TestCoverage)
+                        mask |= (unsigned int)_mm_movemask_pd(inside) << lane;
+                }
+            }
+#endif
+            for(; lane < QUAD_LANES; ++lane) {
+                double E[3];
+                bool inside = true;
+                for(int k = 0; k < 3; ++k) {
+                    E[k] = e.C[k] + quadLanes.offsetX[lane] * e.I[k] + quadLanes.offsetY[lane] * e.J[k];
+                    inside = inside && (E[k] + e.bias[k]) <= 0;
+                }
+                depth[lane] = (float)((E[1] * e.rhw[0] + E[2] * e.rhw[1] + E[0] * e.rhw[2]) * e.one_div_delta);
+                if(TestCoverage)
+                    mask |= (unsigned int)inside << lane;
+            }
+            return mask;
+        }
+    }
+
     JShadingPipeline::VertexData JShadingPipeline::VertexData::lerp(
         const JShadingPipeline::VertexData& v0,
         const JShadingPipeline::VertexData& v1,
@@ -59,12 +182,37 @@ namespace JackalRenderer {
     }
 
     void JShadingPipeline::VertexData::prePerspCorrection(VertexData& v) {
-        v.rhw *= 1.0f / v.cpos.w;
+        v.rhw = 1.0f / v.cpos.w;
         v.pos *= v.rhw;
         v.tex *= v.rhw;
         v.nor *= v.rhw;
     }
 
+    void JShadingPipeline::vertexShaderBatch(const VertexStreamView& vertices, VertexData* out) const {
+        for(size_t i = 0; i < vertices.count; ++i) {
+            vertices.fetch(i, out[i]);
+            vertexShader(out[i]);
+        }
+    }
+
+    void JShadingPipeline::fragmentShaderQuad(const QuadFragments& quad, const unsigned int& activeMask, glm::vec4 fragColors[4]) const {
+        for(int p = 0; p < 4; ++p) {
+            if(activeMask & (1u << p))
+                fragmentShader(quad.fragments[p], fragColors[p], quad.dUVdx, quad.dUVdy);
+        }
+    }
+
+    void JShadingPipeline::VertexData::snapScreenPos(VertexData& v, const glm::vec2& screenPos, const int& subpixelBits) {
+        const int bits = std::max(0, std::min(subpixelBits, (int)SUBPIXEL_BITS));
+        const float snap = static_cast<float>(1 << bits);
+        const int scale = 1 << (SUBPIXEL_BITS - bits);
+        v.fpos.x = static_cast<int>(std::floor(screenPos.x * snap + 0.5f)) * scale;
+        v.fpos.y = static_cast<int>(std::floor(screenPos.y * snap + 0.5f)) * scale;
+        //nearest pixel of the snapped position
+        v.spos.x = static_cast<int>(std::floor((v.fpos.x + SUBPIXEL_ONE / 2) / static_cast<double>(SUBPIXEL_ONE)));
+        v.spos.y = static_cast<int>(std::floor((v.fpos.y + SUBPIXEL_ONE / 2) / static_cast<double>(SUBPIXEL_ONE)));
+    }
+
     void JShadingPipeline::FragmentData::aftPerspCorrection(FragmentData &v) {
         float w = 1.0f / v.rhw;
         v.pos *= w;
@@ -74,187 +222,232 @@ namespace JackalRenderer {
 
     std::vector<JTexture2D::ptr> JShadingPipeline::globalTextureUnits = {};
     std::vector<JLight::ptr> JShadingPipeline::lights = {};
+    JLightTable JShadingPipeline::lightTable;
+    JLightClusters JShadingPipeline::lightClusters;
     glm::vec3 JShadingPipeline::viewerPos = glm::vec3(0.0f);
     float JShadingPipeline::exposure = 1.0f;
 
-    void JShadingPipeline::rasterizeFillEdgeFunction(
-        const VertexData& v0,
-        const VertexData& v1,
-        const VertexData& v2,
-        const uint& screenWidth,
-        const uint& screenHeight,
-        vector<QuadFragments>& rasterized_points) {
-
-        VertexData v[] = {v0, v1, v2};
-        glm::ivec2 boundingMin;
-        glm::ivec2 boundingMax;
-        boundingMin.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), 0);
-        boundingMin.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), 0);
-        boundingMax.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), (int)screenWidth - 1);
-        boundingMax.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), (int)screenHeight - 1);
-
+    bool JShadingPipeline::TriangleSetup::setup(const VertexData& v0, const VertexData& v1, const VertexData& v2, const bool& withAttributes) {
+        const VertexData* v[] = {&v0, &v1, &v2};
         {//make sure the order of vertices are CCW
-            auto e1(v1.spos - v0.spos);
-            auto e2(v2.spos - v0.spos);
-            int orient = e1.x * e2.y - e1.y * e2.x;
-            if(orient > 0)
+            const long long e1x = v1.fpos.x - v0.fpos.x, e1y = v1.fpos.y - v0.fpos.y;
+            const long long e2x = v2.fpos.x - v0.fpos.x, e2y = v2.fpos.y - v0.fpos.y;
+            if(e1x * e2y - e1y * e2x > 0)
                 std::swap(v[1], v[2]);
         }
 
-        // 3 vertices of the triangle in screen space
-        const glm::ivec2& A = v[0].spos;
-        const glm::ivec2& B = v[1].spos;
-        const glm::ivec2& C = v[2].spos;
+        // 3 vertices of the triangle on the fixed point grid, products need 64 bits
+        const glm::i64vec2 A(v[0]->fpos), B(v[1]->fpos), C(v[2]->fpos);
+        I[0] = A.y - B.y; I[1] = B.y - C.y; I[2] = C.y - A.y;
+        J[0] = B.x - A.x; J[1] = C.x - B.x; J[2] = A.x - C.x;
+        K[0] = A.x * B.y - A.y * B.x;
+        K[1] = B.x * C.y - B.y * C.x;
+        K[2] = C.x * A.y - C.y * A.x;
 
-        const int I01 = A.x - B.y, I12 = B.y - C.y, I20 = C.y - A.y;
-        const int J01 = B.x - A.x, J12 = C.x - B.x, J20 = A.x - C.x;
-        const int K01 = A.x * B.y - A.y * B.x;
-        const int K12 = B.x * C.y - B.y * C.x;
-        const int K20 = C.x * A.y - C.y * A.x;
+        //F01 + F12 + F20 实际上是三角形面积的两倍，与位置无关
+        delta = K[0] + K[1] + K[2];
+        //三角形两个顶点或三个顶点坍缩在一起，此时三角形没有实际面积可以渲染
+        if(delta == 0)
+            return false;
+        one_div_delta = 1.0 / (double)delta;
 
-        int F01 = I01 * boundingMin.x + J01 * boundingMin.y + K01;
-        int F12 = I12 * boundingMin.x + J12 * boundingMin.y + K12;
-        int F20 = I20 * boundingMin.x + J20 * boundingMin.y + K20;
+        /*
+         * top-left fill rule: a sampling point exactly on an edge belongs to the triangle only if the edge is
+         * a top or left one. Two triangles sharing an edge see it with opposite I, J so exactly one of them covers it.
+         */
+        for(int k = 0; k < 3; ++k)
+            bias[k] = (I[k] < 0 || (I[k] == 0 && J[k] > 0)) ? 0 : 1;
 
-        //三角形两个顶点或三个顶点坍缩在一起，此时三角形没有实际面积可以渲染
-        if(F01 + F12 + F20 == 0)
+        for(int k = 0; k < 3; ++k)
+            vertexRhw[k] = v[k]->rhw;
+        boundingMin = glm::min(v[0]->spos, glm::min(v[1]->spos, v[2]->spos));
+        boundingMax = glm::max(v[0]->spos, glm::max(v[1]->spos, v[2]->spos));
+        origin = glm::vec2(v[0]->fpos) / static_cast<float>(SUBPIXEL_ONE);
+        //the rasterizer itself only needs the edge functions and the vertex rhw
+        if(!withAttributes)
+            return true;
+
+        //barycentric weights are (E12, E20, E01) / delta, their steps per pixel
+        const glm::vec3 wdx((float)(I[1] * SUBPIXEL_ONE * one_div_delta), (float)(I[2] * SUBPIXEL_ONE * one_div_delta), (float)(I[0] * SUBPIXEL_ONE * one_div_delta));
+        const glm::vec3 wdy((float)(J[1] * SUBPIXEL_ONE * one_div_delta), (float)(J[2] * SUBPIXEL_ONE * one_div_delta), (float)(J[0] * SUBPIXEL_ONE * one_div_delta));
+        buildAttributePlane(v[0]->pos, v[1]->pos, v[2]->pos, wdx, wdy, pos);
+        buildAttributePlane(v[0]->nor, v[1]->nor, v[2]->nor, wdx, wdy, nor);
+        buildAttributePlane(v[0]->tex, v[1]->tex, v[2]->tex, wdx, wdy, tex);
+        buildAttributePlane(v[0]->rhw, v[1]->rhw, v[2]->rhw, wdx, wdy, rhw);
+        needInterpolatedTBN = v[0]->needInterpolatedTBN;
+        if(needInterpolatedTBN)
+            buildAttributePlane(v[0]->tbn, v[1]->tbn, v[2]->tbn, wdx, wdy, tbn);
+        return true;
+    }
+
+    void JShadingPipeline::TriangleSetup::interpolateQuad(const int& x, const int& y, const unsigned int& pixelMask, QuadFragments& quad) const {
+        quad.spos = glm::ivec2(x, y);
+        //top-left pixel from the planes, the other three by one step in x and / or y
+        const float dx = x - origin.x, dy = y - origin.y;
+        FragmentData base;
+        base.pos = pos.at(dx, dy);
+        base.nor = nor.at(dx, dy);
+        base.tex = tex.at(dx, dy);
+        base.rhw = rhw.at(dx, dy);
+        if(needInterpolatedTBN)
+            base.tbn = tbn.at(dx, dy);
+        for(int p = 0; p < 4; ++p) {
+            auto& fragment = quad.fragments[p];
+            if(((pixelMask >> p) & 1u) == 0) {
+                fragment.spos = glm::ivec2(-1); //helper fragment, only for the quad shape
+                continue;
+            }
+            fragment.pos = base.pos;
+            fragment.nor = base.nor;
+            fragment.tex = base.tex;
+            fragment.rhw = base.rhw;
+            if(needInterpolatedTBN)
+                fragment.tbn = base.tbn;
+            if(p & 1) {
+                fragment.pos += pos.ddx; fragment.nor += nor.ddx; fragment.tex += tex.ddx; fragment.rhw += rhw.ddx;
+                if(needInterpolatedTBN)
+                    fragment.tbn += tbn.ddx;
+            }
+            if(p & 2) {
+                fragment.pos += pos.ddy; fragment.nor += nor.ddy; fragment.tex += tex.ddy; fragment.rhw += rhw.ddy;
+                if(needInterpolatedTBN)
+                    fragment.tbn += tbn.ddy;
+            }
+            fragment.spos = glm::ivec2(x + (p & 1), y + (p >> 1));
+        }
+        uvDerivatives(glm::vec2(x + 0.5f, y + 0.5f), quad.dUVdx, quad.dUVdy);
+    }
+
+    void JShadingPipeline::TriangleSetup::uvDerivatives(const glm::vec2& p, glm::vec2& dUVdx, glm::vec2& dUVdy) const {
+        //uv = tex / rhw, both linear in screen space: d(uv) = (d(tex) - uv * d(rhw)) / rhw
+        const float dx = p.x - origin.x, dy = p.y - origin.y;
+        const float q = rhw.at(dx, dy);
+        const float invQ = 1.0f / q;
+        const glm::vec2 uv = tex.at(dx, dy) * invQ;
+        dUVdx = (tex.ddx - uv * rhw.ddx) * invQ;
+        dUVdy = (tex.ddy - uv * rhw.ddy) * invQ;
+    }
+
+    template<int SamplingNum>
+    void JShadingPipeline::rasterizeFillEdgeFunction(
+        const TriangleSetup& triangle,
+        const int& triangleId,
+        const glm::ivec2& clipMin,
+        const glm::ivec2& clipMax,
+        vector<QuadRecord<SamplingNum>>& rasterized_points,
+        JFrameBuffer* hiZ,
+        const bool& depthEqual) {
+
+        glm::ivec2 boundingMin = glm::max(triangle.boundingMin, clipMin);
+        glm::ivec2 boundingMax = glm::min(triangle.boundingMax, clipMax);
+        if(boundingMin.x > boundingMax.x || boundingMin.y > boundingMax.y)
             return;
+        //quads start at even coordinates, the extra column/row is outside the triangle or the clip rect
+        boundingMin.x &= ~1;
+        boundingMin.y &= ~1;
 
         //指定预留内存空间
-        rasterized_points.reserve((boundingMax.y - boundingMin.y) * (boundingMax.x - boundingMax.x));
+        rasterized_points.reserve(rasterized_points.size() + (boundingMax.y - boundingMin.y + 2) * (boundingMax.x - boundingMin.x + 2) / 4);
 
-        /* offset：根据 JMaskPixelSampler::getSamplingNum() 返回的采样点数来设置偏移量。
-         * 如果采样点数 >= 4，则 offset 为 0；否则 offset 为 1。通常情况下，采样点数越多，精度越高，偏移量可以设为 0；
-         * 当采样点较少时，需要增加偏移量来补偿采样不足，避免采样错误。
-        */
-        const float offset = JMaskPixelSampler::getSamplingNum() >= 4 ? 0.0f : +1.0f;
-        const int E1_t = (((B.y > A.y) || (A.y == B.y && A.x < B.x)) ? 0 : offset);
-        const int E2_t = (((C.y > B.y) || (B.y == C.y && B.x < C.x)) ? 0 : offset);
-        const int E3_t = (((A.y > C.y) || (C.y == A.y && C.x < A.x)) ? 0 : offset);
+        const long long* edgeI = triangle.I;
+        const long long* edgeJ = triangle.J;
+        const long long* edgeK = triangle.K;
 
-        int Cy1 = F01, Cy2 = F12, Cy3 = F20;
-        const float one_div_delta = 1.0f / (F01 + F12 + F20);
-        //F01 + F12 + F20 实际上是三角形面积的两倍
+        //edge functions of every sampling point in a quad are evaluated at once, see evaluateQuadEdges
+        QuadEdgeSetup edges;
+        for(int k = 0; k < 3; ++k) {
+            edges.I[k] = (double)edgeI[k];
+            edges.J[k] = (double)edgeJ[k];
+            edges.bias[k] = triangle.bias[k];
+            edges.rhw[k] = triangle.vertexRhw[k];
+        }
+        edges.one_div_delta = triangle.one_div_delta;
+        const QuadSampleLanes<SamplingNum>& quadLanes = getQuadLanes<SamplingNum>();
+        constexpr int samplingNum = SamplingNum;
+        constexpr unsigned int pixelLanes = (1u << samplingNum) - 1;
 
         /*
-         * @brief 计算屏幕坐标对应三角形重心坐标
-         * @param x, y screen coordinates
-        */
-        auto barycentricWeight = [&](const float &x, const float &y) -> glm::vec3 {
-            glm::vec3 s[2];
-            s[0] = glm::vec3(v[2].spos.x - v[0].spos.x, v[1].spos.x - v[0].spos.x, v[0].spos.x - x);
-            s[1] = glm::vec3(v[2].spos.y - v[0].spos.y, v[1].spos.y - v[0].spos.y, v[0].spos.y - y);
-            auto uf = glm::cross(s[0], s[1]);
-            //讨论二维三角形，如果u的z分量不是1则说明P点不在三角形内
-            return glm::vec3(1.0f - (uf.x + uf.y) / uf.z, uf.y / uf.z, uf.x / uf.z); //uf.z != 0
-        };
-
-        auto sampling_is_inside = [&](const int& x, const int& y, const int& Cx1, const int& Cx2, const int& Cx3, FragmentData& p) -> bool {
-            //Invalid, not in the boundingbox
-            if(x > boundingMax.x || y > boundingMax.y) {
-                p.spos = glm::ivec2(-1);//-1表示像素无效
-                return false;
+         * @brief classifies a block against the triangle by the edge functions at the corners of its sampling area,
+         * the quads of the block cover [blockMin, blockMax | 1] and samples lie within half a pixel of the pixel center
+         * @return -1 all samples outside, 1 all samples inside, 0 partially covered
+         */
+        auto classifyBlock = [&](const glm::ivec2& blockMin, const glm::ivec2& blockMax) -> int {
+            const long long x0 = (long long)blockMin.x * SUBPIXEL_ONE - SUBPIXEL_ONE / 2, x1 = (long long)(blockMax.x | 1) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+            const long long y0 = (long long)blockMin.y * SUBPIXEL_ONE - SUBPIXEL_ONE / 2, y1 = (long long)(blockMax.y | 1) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+            bool allInside = true;
+            for(int k = 0; k < 3; ++k) {
+                const long long c[4] = {edgeI[k] * x0 + edgeJ[k] * y0 + edgeK[k], edgeI[k] * x1 + edgeJ[k] * y0 + edgeK[k],
+                                        edgeI[k] * x0 + edgeJ[k] * y1 + edgeK[k], edgeI[k] * x1 + edgeJ[k] * y1 + edgeK[k]};
+                if(std::min(std::min(c[0], c[1]), std::min(c[2], c[3])) + triangle.bias[k] > 0)
+                    return -1;
+                allInside = allInside && std::max(std::max(c[0], c[1]), std::max(c[2], c[3])) + triangle.bias[k] <= 0;
             }
-            bool atLeastOneInside = false;//至少一个采样点在三角形内
-            const int samplingNum = JMaskPixelSampler::getSamplingNum();
-            auto samplingOffsetArray = JMaskPixelSampler::getSamplingOffsets(); //一个像素点， 四个采样点
-#pragma unroll //expand the loop, optimize the performance
-            for (int s = 0; s < samplingNum; ++s) {
-                const auto &offset = samplingOffsetArray[s];
-                //Edge function
-                const float E1 = Cx1 + offset.x * I01 + offset.y * J01;
-                const float E2 = Cx2 + offset.x * I12 + offset.y * J12;
-                const float E3 = Cx3 + offset.x * I20 + offset.y + J20;
-                //make sure CCW / counter clockwise
-                if((E1 + E1_t) <= 0 && (E2 + E2_t) <= 0 && (E3 + E3_t) <= 0) {
-                    atLeastOneInside = true;
-                    p.coverage[s] = 1; // 第s个采样点在三角形内
-                    glm::vec3 uvw = glm::vec3(E2, E3, E1) * one_div_delta;
-                    p.coverageDepth[s] = VertexData::barycentricLerp(v[0].rhw, v[1].rhw, v[2].rhw, uvw);
-                }
-            }
-
-            if(!atLeastOneInside) //所有采样点点都不在三角形内部，丢弃像素
-                p.spos = glm::ivec2(-1);
-            return atLeastOneInside;
+            return allInside ? 1 : 0;
         };
 
-        for(int y = boundingMin.y; y <= boundingMax.y; y += 2) {
-            int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
-#pragma unroll 4
-            for(int x = boundingMin.x; x <= boundingMax.x; x += 2) {
-                //no adaptive method but just 2 x 2 block based
-                QuadFragments group; // 四个像素点， 一个block
-                bool inside0 = sampling_is_inside(x, y, Cx1, Cx2, Cx3, group.fragments[0]);
-                bool inside1 = sampling_is_inside(x + 1, y, Cx1 + I01, Cx2 + I12, Cx3 + I20, group.fragments[1]);
-                bool inside2 = sampling_is_inside(x, y + 1, Cx1 + J01, Cx2 + J12, Cx2 + J20, group.fragments[2]);
-                bool inside3 = sampling_is_inside(x + 1, y + 1, Cx1 + I01 + J01, Cx2 + I12 + J12, Cx3 + I20 + J20, group.fragments[3]);
-                //至少一个采样点在三角形中
-                if(inside0 || inside1 || inside2 || inside3) {
-                    if(!inside0) {
-                        group.fragments[0] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentricWeight(x, y));
-                        group.fragments[0].spos = glm::ivec2(-1);//无效置-1
-                    }else {
-                        glm::vec3 uvw(Cx2, Cx3, Cx1);
-                        auto coverage = group.fragments[0].coverage;
-                        auto coverage_depth = group.fragments[0].coverageDepth;
-                        group.fragments[0] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-                        //现场还原
-                        group.fragments[0].spos = glm::ivec2(x, y);
-                        group.fragments[0].coverage = coverage;
-                        group.fragments[0].coverageDepth = coverage_depth;
-                    }
-
-                    if(!inside1) {
-                        group.fragments[1] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentricWeight(x + 1, y));
-                        group.fragments[1].spos = glm::ivec2(-1);
-                    }else {
-                        glm::vec3 uvw(Cx2 + I12, Cx3 + I20, Cx1 + I01);
-                        auto coverage = group.fragments[1].coverage;
-                        auto coverage_depth = group.fragments[1].coverageDepth;
-                        group.fragments[1] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-                        group.fragments[1].spos = glm::ivec2(x + 1, y);
-                        group.fragments[1].coverage = coverage;
-                        group.fragments[1].coverageDepth = coverage_depth;
-                    }
+        //nearest depth of the triangle, rhw is linear in screen space so it is reached at a vertex
+        const float nearestDepth = std::max(triangle.vertexRhw[0], std::max(triangle.vertexRhw[1], triangle.vertexRhw[2]));
+        constexpr int blockSize = JFrameBuffer::HIZ_BLOCK_SIZE;
 
-                    if(!inside2) {
-                        group.fragments[2] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentricWeight(x, y + 1));
-                        group.fragments[2].spos = glm::ivec2(-1);
-                    }else {
-                        glm::vec3 uvw(Cx2 + J12, Cx3 + J20, Cx1 + J01);
-                        auto coverage = group.fragments[2].coverage;
-                        auto coverage_depth = group.fragments[2].coverageDepth;
-                        group.fragments[2] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-                        group.fragments[2].spos = glm::ivec2(x, y + 1);
-                        group.fragments[2].coverage = coverage;
-                        group.fragments[2].coverageDepth = coverage_depth;
-                    }
+        //walk the bounding box block by block so that blocks already covered by nearer geometry are skipped as a whole
+        for(int by = boundingMin.y - boundingMin.y % blockSize; by <= boundingMax.y; by += blockSize) {
+            for(int bx = boundingMin.x - boundingMin.x % blockSize; bx <= boundingMax.x; bx += blockSize) {
+                const glm::ivec2 blockMin(std::max(bx, boundingMin.x), std::max(by, boundingMin.y));
+                const glm::ivec2 blockMax(std::min(bx + blockSize - 1, boundingMax.x), std::min(by + blockSize - 1, boundingMax.y));
+                if(hiZ != nullptr && hiZ -> isHiZOccluded(blockMin, blockMax, nearestDepth, depthEqual))
+                    continue;
+                const int blockClass = classifyBlock(blockMin, blockMax);
+                if(blockClass < 0)
+                    continue;
+                //fully covered blocks skip the per sample inside test
+                const bool fullyCovered = blockClass > 0;
+                for(int y = blockMin.y; y <= blockMax.y; y += 2) {
+                    //edge functions at the pixel center of (blockMin.x, y)
+                    long long Cx[3];
+                    for(int k = 0; k < 3; ++k)
+                        Cx[k] = (edgeI[k] * blockMin.x + edgeJ[k] * y) * SUBPIXEL_ONE + edgeK[k];
+#pragma unroll 4
+                    for(int x = blockMin.x; x <= blockMax.x; x += 2) {
+                        //no adaptive method but just 2 x 2 block based
+                        for(int k = 0; k < 3; ++k)
+                            edges.C[k] = (double)Cx[k];
+                        for(int k = 0; k < 3; ++k)
+                            Cx[k] += 2 * edgeI[k] * SUBPIXEL_ONE;
 
-                    if(!inside3) {
-                        group.fragments[3] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentricWeight(x + 1, y + 1));
-                        group.fragments[3].spos = glm::ivec2(-1);
-                    }else {
-                        glm::vec3 uvw(Cx2 + I12 + J12, Cx3 + I20 + J20, Cx1 + I01 + J01);
-                        auto coverage = group.fragments[3].coverage;
-                        auto coverage_depth = group.fragments[3].coverageDepth;
-                        group.fragments[3] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-                        group.fragments[3].spos = glm::ivec2(x + 1, y + 1);
-                        group.fragments[3].coverage = coverage;
-                        group.fragments[3].coverageDepth = coverage_depth;
+                        //the record is written in place and dropped again if nothing is covered
+                        rasterized_points.emplace_back();
+                        QuadRecord<SamplingNum>& group = rasterized_points.back(); // 四个像素点， 一个block
+                        unsigned int laneMask = fullyCovered ? evaluateQuadEdges<SamplingNum, false>(edges, quadLanes, group.depth)
+                                                             : evaluateQuadEdges<SamplingNum, true>(edges, quadLanes, group.depth);
+                        //pixels out of the clip rect or the bounding box are invalid
+                        for(int p = 0; p < 4; ++p) {
+                            const int px = x + (p & 1), py = y + (p >> 1);
+                            if(px < clipMin.x || py < clipMin.y || px > boundingMax.x || py > boundingMax.y)
+                                laneMask &= ~(pixelLanes << (p * samplingNum));
+                        }
+                        //至少一个采样点在三角形中
+                        if(laneMask == 0) {
+                            rasterized_points.pop_back();
+                            continue;
+                        }
+                        group.triangle = triangleId;
+                        group.spos = glm::ivec2(x, y);
+                        group.coverage = laneMask;
                     }
-                    rasterized_points.push_back(group);
                 }
-                Cx1 += 2 * I01;
-                Cx2 += 2 * I12;
-                Cx3 += 2 * I20;
             }
-            Cy1 += 2 * J01;
-            Cy2 += 2 * J12;
-            Cy3 += 2 * J20;
         }
     }
 
+#define JACKAL_INSTANTIATE_RASTERIZER(N) \
+    template void JShadingPipeline::rasterizeFillEdgeFunction<N>(const TriangleSetup&, const int&, \
+        const glm::ivec2&, const glm::ivec2&, vector<QuadRecord<N>>&, JFrameBuffer*, const bool&);
+    JACKAL_INSTANTIATE_RASTERIZER(1)
+    JACKAL_INSTANTIATE_RASTERIZER(2)
+    JACKAL_INSTANTIATE_RASTERIZER(4)
+    JACKAL_INSTANTIATE_RASTERIZER(8)
+#undef JACKAL_INSTANTIATE_RASTERIZER
+
     int JShadingPipeline::uploadTexture2D(JTexture2D::ptr tex) {
         if(tex != nullptr) {
             globalTextureUnits.push_back(tex);
@@ -283,22 +476,46 @@ namespace JackalRenderer {
         return lights[idx];
     }
 
+    void JShadingPipeline::compileLights(const glm::mat4& view, const glm::mat4& project, const int& width, const int& height,
+        const float& near, const float& far) {
+        lightTable.compile(lights);
+        lightClusters.build(lightTable, view, project, width, height, near, far);
+    }
+
+    void JShadingPipeline::prepareLights() {
+        auto products = std::make_shared<LightProducts>();
+        products -> ambient.resize(lightTable.size());
+        products -> diffuse.resize(lightTable.size());
+        for(size_t i = 0; i < lightTable.size(); ++i) {
+            products -> ambient[i] = lightTable.intensity[i] * kA;
+            products -> diffuse[i] = lightTable.intensity[i] * kD;
+        }
+        lightProducts = products;
+    }
+
     /*
      * @param idx 纹理编号
      * @param uv 纹理坐标
      * @param dUVdx, dUVdy UV坐标相对于屏幕空间x和y方向的导数，主要用于计算MipMap的选择
      */
     glm::vec4 JShadingPipeline::texture2D(const uint& idx, const glm::vec2& uv, const glm::vec2& dUVdx, const glm::vec2 &dUVdy) {
+        return texture2DLod(idx, uv, textureLod(idx, dUVdx, dUVdy));
+    }
+
+    float JShadingPipeline::textureLod(const uint& idx, const glm::vec2& dUVdx, const glm::vec2& dUVdy) {
+        if(idx < 0 || idx >= globalTextureUnits.size() || !globalTextureUnits[idx] -> isGeneratedMipmap())
+            return 0.0f;
+        const auto& texture = globalTextureUnits[idx];
+        glm::vec2 dfdx = dUVdx * glm::vec2(texture -> getWidth(), texture -> getHeight());
+        glm::vec2 dfdy = dUVdy * glm::vec2(texture -> getWidth(), texture -> getHeight());
+        float L = glm::max(glm::dot(dfdx, dfdx), glm::dot(dfdy, dfdy));
+        //LOD Level of Detail 细节级别，公式为0.5f * log2(L)
+        return glm::max(0.5f * glm::log2(L), 0.0f);
+    }
+
+    glm::vec4 JShadingPipeline::texture2DLod(const uint& idx, const glm::vec2& uv, const float& lod) {
         if(idx < 0 || idx >= globalTextureUnits.size())
             return glm::vec4(0.0f);//采样失败
-        const auto& texture = globalTextureUnits[idx];
-        if(texture -> isGeneratedMipmap()) {
-            glm::vec2 dfdx = dUVdx * glm::vec2(texture -> getWidth(), texture -> getHeight());
-            glm::vec2 dfdy = dUVdy * glm::vec2(texture -> getWidth(), texture -> getHeight());
-            float L = glm::max(glm::dot(dfdx, dfdx), glm::dot(dfdy, dfdy));
-            //LOD Level of Detail 细节级别，公式为0.5f * log2(L)
-            return texture -> sample(uv, glm::max(0.5f * glm::log2(L), 0.0f));
-        }else
-            return texture -> sample(uv);
+        return globalTextureUnits[idx] -> sample(uv, lod);
     }
 }